@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <string>
+#include "opencl.h"
+
+// Usage: devices [spec] [bench], lists the capabilities of all OpenCL devices under their "P:D"
+// indexes and the device chosen by the selection spec (default: OPENCL_DEVICE or the best GPU,
+// accelerator or CPU device), "bench" also times the selection benchmark kernel on every device
+
+int main(int argc, char** argv)
+{
+    std::string spec = argc > 1 ? argv[1] : "";
+    bool bench = argc > 2 && std::string(argv[2]) == "bench";
+
+    printf("\n~~~~~ OpenCL devices\n");
+    std::vector<DeviceInfo> devices = listDevices();
+    if (devices.empty()) { printf("No OpenCL devices found\n"); return 1; }
+
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        printf("\n[%d:%d] ", devices[i].platformIndex, devices[i].deviceIndex);
+        printDeviceInfo(devices[i]);
+        if (bench) printf("  benchmark:        %.3f ms\n", benchmarkDevice(devices[i]));
+    }
+
+    printf("\n~~~~~ Selected device\n");
+    try {
+        auto context = Context::create(false, spec);
+        printDeviceInfo(context->deviceInfo());
+    }
+    catch (const OpenClError& e) {
+        printf("Error: %s\n", e.what());
+        return 1;
+    }
+
+    printf("\n~~~~~ Bye!\n");
+    return 0;
+}
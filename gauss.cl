@@ -2,82 +2,253 @@
 
 // #pragma OPENCL EXTENSION cl_khr_fp64 : enable // Uncomment if using printf
 
-// One step of forward elimination
+// Build-time constants: -DDIM=<matrix dimension> [-DBS=<block size>] [-DTS=<LU update tile>]
+//                       [-DRS=<residual work-group size, power of two>]
+//                       [-DFT=<max work-group extent of forward elimination per dimension>]
+
+#ifndef DIM
+#error "DIM must be defined with -DDIM=<matrix dimension>"
+#endif
+
+#ifndef BS
+#define BS 32
+#endif
+
+#ifndef TS
+#define TS 16
+#endif
+
+#ifndef RS
+#define RS 64
+#endif
+
+#ifndef FT
+#define FT 64
+#endif
+
+#define W (DIM + 1) // row width of the extended matrix
+
+// One step of forward elimination: rows below col minus ratio times the pivot row col
+// Work-items are tiles of (columns x rows) of the trailing matrix, the pivot row segment and
+// the row ratios of a tile are cached in local memory. The entries of column col below the
+// diagonal are not cleared, as only the upper triangle is used by backward substitution.
+// Global size: { ceil((DIM - col) / FX) * FX, ceil((DIM - col - 1) / FY) * FY },
+// local size: { FX, FY } with FX, FY <= FT
 
 __kernel void zeroOutCol(
-    __global float *m, 
-    __global float *result, 
-    __global float *errors, 
+    __global float *m,
     const int col
 ) {
-    __local float ratio;
-    __local int w, d;
+    __local float pivot[FT];
+    __local float ratio[FT];
 
-    int j = get_global_id(0);
-    int k = get_local_id(1);
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int j = col + 1 + get_global_id(0);
+    int i = col + 1 + get_global_id(1);
 
-    if (k == 0) {
-        d = get_global_size(0);
-        w = d + 1;
-        ratio = m[j * w + col] / m[col * w + col];
-    }
+    if (ly == 0) pivot[lx] = j < W ? m[col * W + j] : 0;
+    if (lx == 0) ratio[ly] = i < DIM ? m[i * W + col] / m[col * W + col] : 0;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (j > col && j < d) {
-        if (k == col) m[j * w + k] = 0;
-        else if (k > col && k <= d) m[j * w + k] -= ratio * m[col * w + k];
-    }
+    if (i < DIM && j < W) m[i * W + j] -= ratio[ly] * pivot[lx];
 }
 
-// One step of backward substitution
+/**************************************************************************************************
+ * Backward substitution and residual check
+ *
+ * Backward substitution sweeps blocks of BS rows from the bottom. Launch p (col = p * BS) uses
+ * the already solved roots of block p to update the right-hand side of all rows above it, one
+ * work-group per row block, and the last work-group then solves its own diagonal block. The
+ * first launch (col >= DIM) only solves the bottom block, so ceil(DIM / BS) launches in total.
+ *
+ **************************************************************************************************/
+
+// Global size: { p * BS }, local size: { BS }
 
-__kernel void calcRoot(
-    __global float *m, 
-    __global float *result, 
-    __global float *errors, 
+__kernel void backSubst(
+    __global float *m,
+    __global float *result,
     const int col
 ){
-    __local int w, d;
-    __local float r;
+    __local float x[BS];
+    __local float u[BS][BS + 1];
+
+    int lid = get_local_id(0);
+    int group = get_group_id(0);
+    int solved = min(BS, DIM - col);    // roots known in [col, col + solved)
+    int i = group * BS + lid;
 
-    int row = get_local_id(0);
+    if (lid < solved) x[lid] = result[col + lid];
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (row == col) {
-        d = get_global_size(0);
-        w = d + 1;
-        r = m[row * w + d] / m[row * w + row];
-        result[row] = r;
+    float rhs = 0;
+    if (i < DIM) {
+        rhs = m[i * W + DIM];
+        for (int t = 0; t < solved; t++) rhs -= m[i * W + col + t] * x[t];
+        m[i * W + DIM] = rhs;
+    }
+
+    if (group != get_num_groups(0) - 1) return;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // solve the diagonal block of the last work-group
+
+    int b0 = group * BS;
+    int nb = min(BS, DIM - b0);
+    if (lid < nb) {
+        for (int c = lid; c < nb; c++) u[lid][c] = m[i * W + b0 + c];
+        x[lid] = rhs;
     }
-    
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (row < col) {
-        m[row * w + d] -= m[row * w + col] * r;
+    for (int c = nb - 1; c >= 0; c--) {
+        if (lid == c) x[c] /= u[c][c];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < c) x[lid] -= u[lid][c] * x[c];
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+
+    if (lid < nb) result[b0 + lid] = x[lid];
 }
 
-// Calculate the error for each row
+// Residual of each row m[i][DIM] - sum(m[i][j] * result[j]), one work-group of RS items per row
+// Global size: { DIM * RS }, local size: { RS }
 
-__kernel void calcError(
-    __global float *m, 
-    __global float *result,
-    __global float *errors, 
-    const int col
+__kernel void calcResidual(
+    __global const float *m,
+    __global const float *result,
+    __global float *errors
 ){
+    __local float part[RS];
 
-    __local int w, d;
-    __local float r;
+    int lid = get_local_id(0);
+    int row = get_group_id(0);
 
-    int row = get_local_id(0);
+    float sum = 0;
+    for (int j = lid; j < DIM; j += RS) sum += m[row * W + j] * result[j];
+    part[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (row == 0) {
-        d = get_global_size(0);
-        w = d + 1;
-        r = result[col];
+    for (int s = RS / 2; s > 0; s >>= 1) {
+        if (lid < s) part[lid] += part[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    if (col == 0) errors[row] = m[row * w + d];
-    
+
+    if (lid == 0) errors[row] = m[row * W + DIM] - part[0];
+}
+
+/**************************************************************************************************
+ * Blocked right-looking LU factorization of the extended matrix
+ *
+ * For each panel of BS columns starting at col, three launches:
+ *   luDiag   - factor the BS x BS diagonal block in place (one work-group)
+ *   luPanel  - compute the L multipliers below the block and the U rows right of it
+ *   luUpdate - subtract L21 * U12 from the trailing matrix with a tiled kernel
+ * Multipliers are kept below the diagonal, the right-hand side column is transformed with
+ * the matrix, so backward substitution works unchanged on the upper triangle.
+ *
+ **************************************************************************************************/
+
+// Factor the diagonal block, one work-item per block row
+// Global size: { BS }, local size: { BS }
+
+__kernel void luDiag(
+    __global float *m,
+    const int col
+) {
+    __local float blk[BS][BS + 1];
+
+    int r = get_local_id(0);
+    int nb = min(BS, DIM - col);
+
+    if (r < nb)
+        for (int c = 0; c < nb; c++) blk[r][c] = m[(col + r) * W + col + c];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int c = 0; c < nb - 1; c++) {
+        if (r > c && r < nb) {
+            float l = blk[r][c] / blk[c][c];
+            for (int t = c + 1; t < nb; t++) blk[r][t] -= l * blk[c][t];
+            blk[r][c] = l;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (r < nb)
+        for (int c = 0; c < nb; c++) m[(col + r) * W + col + c] = blk[r][c];
+}
+
+// Compute L21 (rows below the block) and U12 (block rows right of the block)
+// Work-groups [0, rowGroups) handle one row each work-item, the rest handle one column each
+// Global size: { (rowGroups + colGroups) * BS }, local size: { BS }
+
+__kernel void luPanel(
+    __global float *m,
+    const int col
+) {
+    __local float blk[BS][BS + 1];
+
+    int lid = get_local_id(0);
+    int group = get_group_id(0);
+    int nb = min(BS, DIM - col);
+    int rowGroups = (DIM - col - nb + BS - 1) / BS;
+
+    if (lid < nb)
+        for (int c = 0; c < nb; c++) blk[lid][c] = m[(col + lid) * W + col + c];
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    errors[row] -= m[row * w + col] * r;
+    float v[BS];
+
+    if (group < rowGroups) {
+        // row of L21: solve x * U11 = a
+        int i = col + nb + group * BS + lid;
+        if (i >= DIM) return;
+        for (int c = 0; c < nb; c++) v[c] = m[i * W + col + c];
+        for (int c = 0; c < nb; c++) {
+            v[c] /= blk[c][c];
+            for (int t = c + 1; t < nb; t++) v[t] -= v[c] * blk[c][t];
+        }
+        for (int c = 0; c < nb; c++) m[i * W + col + c] = v[c];
+    }
+    else {
+        // column of U12: solve L11 * x = a with unit diagonal
+        int j = col + nb + (group - rowGroups) * BS + lid;
+        if (j >= W) return;
+        for (int c = 0; c < nb; c++) v[c] = m[(col + c) * W + j];
+        for (int c = 0; c < nb; c++)
+            for (int t = c + 1; t < nb; t++) v[t] -= blk[t][c] * v[c];
+        for (int c = 0; c < nb; c++) m[(col + c) * W + j] = v[c];
+    }
+}
+
+// Trailing update A22 -= L21 * U12, one output element per work-item
+// Global size: { ceil(cols / TS) * TS, ceil(rows / TS) * TS }, local size: { TS, TS },
+// where rows and cols are the trailing matrix sizes
+
+__kernel void luUpdate(
+    __global float *m,
+    const int col
+) {
+    __local float tl[TS][TS + 1];
+    __local float tu[TS][TS + 1];
+
+    int lc = get_local_id(0);
+    int lr = get_local_id(1);
+    int nb = min(BS, DIM - col);
+    int j = col + nb + get_global_id(0);
+    int i = col + nb + get_global_id(1);
+
+    float acc = 0;
+    for (int c0 = 0; c0 < nb; c0 += TS) {
+        tl[lr][lc] = (i < DIM && c0 + lc < nb) ? m[i * W + col + c0 + lc] : 0;
+        tu[lr][lc] = (j < W && c0 + lr < nb) ? m[(col + c0 + lr) * W + j] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int k = 0; k < TS; k++) acc += tl[lr][k] * tu[k][lc];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (i < DIM && j < W) m[i * W + j] -= acc;
 }
@@ -3,16 +3,28 @@
 #include <time.h>
 #include <cmath>
 #include "opencl.h"
+#include "reduce.h"
+#include "graph.h"
+#include "sequence.h"
 
 const char* CL_KERNEL_SOURCE = "gauss.cl";
 const char* CL_KERNEL_FW    = "zeroOutCol";
-const char* CL_KERNEL_BW    = "calcRoot";
-const char* CL_KERNEL_CHECK = "calcError";
+const char* CL_KERNEL_BW    = "backSubst";
+const char* CL_KERNEL_CHECK = "calcResidual";
+const char* CL_KERNEL_LU_DIAG   = "luDiag";
+const char* CL_KERNEL_LU_PANEL  = "luPanel";
+const char* CL_KERNEL_LU_UPDATE = "luUpdate";
+enum { KERNEL_FW, KERNEL_BW, KERNEL_CHECK, KERNEL_LU_DIAG, KERNEL_LU_PANEL, KERNEL_LU_UPDATE };
 
 const size_t DIM  = 1000;              // 2D square matrix dimension
 const size_t SIZE = DIM * (DIM + 1);   // 1D array size for 2D extended matrix
 #define ID(r, c) ((r)*(DIM+1)+(c))     // 1D index for 2D extended matrix
 
+const size_t BS = 32;                  // block size of LU panels and backward substitution
+const size_t TS = 16;                  // tile size of blocked LU trailing update
+const size_t RS = 64;                  // work-group size of residual check, power of two
+const size_t FT = 64;                  // max work-group extent of column elimination per dimension
+
 /*
 void printMatrix(float* matrix)
 {
@@ -43,45 +55,114 @@ void printVector(float* vector)
     printf("\n");
 }
 
-int main()
+// Usage: gauss [blocked|column], "blocked" (default) factors panels of BS columns per launch,
+// "column" eliminates one column per launch
+
+int main(int argc, char** argv)
 {
     try { 
 
-        srand(time(NULL));
+        std::string mode = argc > 1 ? argv[1] : "blocked";
+        if (mode != "blocked" && mode != "column") throw std::runtime_error("unknown mode " + mode);
 
-        size_t tsStart, tsEnd;
+        srand(time(NULL));
 
         // Input data
 
-        // float *m = new float[SIZE]{1, 5, -1, 4, 8, -9, 2, -10, 3, 5, 11, -8}, *result = new float[DIM], *errors = new float[DIM];  // test data
+        // float *m = new float[SIZE]{1, 5, -1, 4, 8, -9, 2, -10, 3, 5, 11, -8}, *result = new float[DIM];  // test data
 
-        float *m = new float[SIZE], *result = new float[DIM], *errors = new float[DIM];
+        float *m = new float[SIZE], *result = new float[DIM];
         for (int i = 0; i < SIZE; i++) m[i] = (rand() % 2001 - 1000) / 100.0f;
 
         printf("\n~~~~~ Let's go with OpenCL\n");
 
-        OpenCL job(CL_KERNEL_SOURCE, std::vector<std::string>{ CL_KERNEL_FW, CL_KERNEL_BW, CL_KERNEL_CHECK });
-
-        tsStart = getTime();
+        TimeSpan spanOpenCL("with OpenCL");
+        TimeSpan spanInit("init");
+        BuildOptions options = BuildOptions().define("DIM", DIM).define("BS", BS).define("TS", TS).define("RS", RS).define("FT", FT);
+        OpenCL job(
+            CL_KERNEL_SOURCE,
+            std::vector<std::string>{ CL_KERNEL_FW, CL_KERNEL_BW, CL_KERNEL_CHECK, CL_KERNEL_LU_DIAG, CL_KERNEL_LU_PANEL, CL_KERNEL_LU_UPDATE },
+            false,
+            options
+        );
+        Reducer reduce(job.context());
+        spanInit.stop();
+        printf("Device %s (%s)\n", job.context()->deviceInfo().name.c_str(), job.context()->deviceInfo().typeName().c_str());
+        printf("Program %s in %.3f ms\n", job.programFromCache() ? "loaded from binary cache" : "compiled from source", job.programBuildTime());
+
+        TimeSpan spanSolve("solve");
         int col = 0;
-        auto args = std::vector<std::tuple<ArgTypes, void*, size_t>>{
-            {ArgTypes::IN_FBUF,      (void*)m,      SIZE },
-            {ArgTypes::OUT_FBUF,     (void*)result, DIM  },
-            {ArgTypes::OUT_FBUF,     (void*)errors, DIM  },
-            {ArgTypes::INT,          (void*)&col,   1    }
-        };
-        job.createBuffers(args);
-        for (col = 0; col < DIM; col++) job.runKernel(0, args, { DIM, DIM+1 }, { 1, DIM+1 });   // forward elimination
-        for (col = DIM-1; col >= 0; col--) job.runKernel(1, args, { DIM }, { DIM } );           // backward substitution
-        job.writeBuffers(args);                                                                 // write back the original matrix
-        for (col = 0; col < DIM; col++) job.runKernel(2, args, { DIM }, { DIM } );              // check errors
-        job.readBuffers(args);
-
-        tsEnd = getTime();
-        size_t tsWopenCL = tsEnd - tsStart;
-
-        float err = fabs(errors[0]);
-        for (size_t i = 1; i < DIM; i++) if (fabs(errors[i]) > err) err = fabs(errors[i]);
+        DeviceBuffer& matrix = job.buffer<float>("matrix", SIZE);               // device-resident, shared by all kernels
+        DeviceBuffer& roots = job.buffer<float>("roots", DIM);
+        DeviceBuffer& residuals = job.buffer<float>("residuals", DIM);
+        {
+            TimeSpan span("upload");
+            job.write(matrix, m, SIZE);
+        }
+        // The elimination is a fixed launch sequence that differs only in col, so it is recorded
+        // once and replayed, as one command buffer when the device has cl_khr_command_buffer
+
+        CommandSequence elimination(job);
+        {
+            TimeSpan span("record elimination");
+            if (mode == "blocked")
+            {
+                for (col = 0; col < DIM; col += BS)
+                {
+                    size_t nb = std::min(BS, DIM - col);
+                    size_t rows = DIM - col - nb, cols = DIM + 1 - col - nb;        // trailing matrix size
+                    size_t groups = (rows + BS - 1) / BS + (cols + BS - 1) / BS;
+                    elimination.record(KERNEL_LU_DIAG, {{ BS }, { BS }}, matrix, scalar(col));
+                    elimination.record(KERNEL_LU_PANEL, {{ groups * BS }, { BS }}, matrix, scalar(col));
+                    if (rows > 0) elimination.record(KERNEL_LU_UPDATE, {{ (cols + TS - 1) / TS * TS, (rows + TS - 1) / TS * TS }, { TS, TS }}, matrix, scalar(col));
+                }
+            }
+            else
+            {
+                // Tile tuned on the first, largest column with FT as the largest extent, the local
+                // arrays of the kernel hold FT entries. Later columns round up to the same tile
+                NDRange first({ (DIM + FT - 1) / FT * FT, (DIM - 1 + FT - 1) / FT * FT }, { FT, FT });
+                NDRange tile = job.tune(KERNEL_FW, first, matrix, scalar(0));
+                size_t fx = tile.local[0], fy = tile.local[1];
+
+                for (col = 0; col + 1 < DIM; col++)
+                {
+                    size_t rows = DIM - col - 1, cols = DIM - col;                 // trailing matrix size
+                    elimination.record(KERNEL_FW, {{ (cols + fx - 1) / fx * fx, (rows + fy - 1) / fy * fy }, { fx, fy }}, matrix, scalar(col));
+                }
+            }
+            elimination.finalize();
+        }
+        {
+            TimeSpan span("forward elimination");
+            elimination.replay();
+            job.finish();
+        }
+
+        // Backward substitution, residual check and readback run as a task graph: the original
+        // matrix is uploaded to its own buffer while the substitution runs, instead of restoring
+        // the eliminated matrix afterwards, and the roots are read back while the check runs
+
+        TaskGraph graph(job.context());
+        float err;
+        {
+            TimeSpan span("backward substitution and check");
+            DeviceBuffer& original = job.buffer<float>("original", SIZE);
+            std::vector<TaskGraph::Node> solved;
+            size_t blocks = (DIM + BS - 1) / BS;
+            for (size_t p = blocks; p > 0; p--)
+            {
+                col = p * BS;                                                   // first row of the solved block
+                solved = { graph.kernel(job, KERNEL_BW, {{ p * BS }, { BS }}, solved, matrix, roots, scalar(col)) };
+            }
+            TaskGraph::Node upload = graph.write(original, m, SIZE);
+            graph.kernel(job, KERNEL_CHECK, {{ DIM * RS }, { RS }}, { solved.front(), upload }, original, roots, residuals);
+            graph.read(roots, result, DIM, solved);
+            graph.run();
+            err = reduce.maxAbs<float>(residuals, DIM);                         // only the max residual is read back
+        }
+        double tsWopenCL = spanSolve.stop() * 1e-6;
+        spanOpenCL.stop();
 
         printVector(result);
         printf("\nError: %f\n", err);
@@ -93,7 +174,8 @@ int main()
         float *mc = new float[SIZE];
         for(int i = 0; i < SIZE; i++) mc[i] = m[i];
         
-        tsStart = getTime();
+        TimeSpan spanCPU("without OpenCL");
+        TimeSpan spanForward("forward elimination");
 
         //~~~ transform matrix to a triangular form
         
@@ -106,8 +188,11 @@ int main()
             }
         }
 
+        spanForward.stop();
+
         //~~~ calculate roots
         
+        TimeSpan spanBackward("backward substitution");
         for(int i = DIM-1; i >= 0; i--)
         {
             result[i] = m[ID(i,DIM)];
@@ -115,8 +200,11 @@ int main()
             result[i] = result[i] / m[ID(i,i)];
         }
         
+        spanBackward.stop();
+
         //~~~ calculate error
 
+        TimeSpan spanCheck("check errors");
         err = 0;
         for(int i = 0; i < DIM; i++) {
             float sum = 0;
@@ -124,8 +212,8 @@ int main()
             err = std::max<float>(err, fabs(mc[ID(i,DIM)] - sum));
         }
 
-        tsEnd = getTime();
-        size_t tsWOopenCL = tsEnd - tsStart;
+        spanCheck.stop();
+        double tsWOopenCL = spanCPU.stop() * 1e-6;
 
         printVector(result);
         printf("\nError: %f\n", err);
@@ -133,11 +221,15 @@ int main()
         delete [] m;
         delete [] mc;
         delete [] result;
-        delete [] errors;
 
         printf("\n~~~~~ Execution time\n");
-        printf("     with OpenCL: %zu ms\n", tsWopenCL);
-        printf("  without OpenCL: %zu ms\n", tsWOopenCL);
+        printf("     with OpenCL: %.3f ms (%s elimination)\n", tsWopenCL, mode.c_str());
+        printf("  without OpenCL: %.3f ms\n", tsWOopenCL);
+        printf(" launch overhead: %.1f us per solve, %zu launches (%s)\n", elimination.stats().lastUs, elimination.size(),
+            elimination.commandBuffer() ? "command buffer" : "replayed launches");
+        printf("\n");
+        graph.printTiming();
+        printTimeReport();
         printf("\n~~~~~ Bye!\n");
     }
     catch (const OpenClError& e)
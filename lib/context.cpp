@@ -0,0 +1,680 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "context.h"
+#include "timer.h"
+#include <sys/stat.h>
+
+//~~~~~ OpenCL error class ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+OpenClError::OpenClError(cl_int err, const std::string& operation)
+    : std::runtime_error("OpenCL error during " + operation + ": " + std::to_string(err)) {}
+
+OpenClError::OpenClError(const std::string& message)
+    : std::runtime_error(message) {}
+
+/**************************************************************************************************
+ * OpenCL context
+ *
+ * The context owns the platform, device, OpenCL context, command queues and the buffer pool.
+ * Programs, kernels, jobs and device buffers created against one context share its device memory.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Constructor and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+Context::Context(bool profiling, const std::string& device)
+    : Context(selectDevice(device), profiling) {}
+
+Context::Context(const DeviceInfo& device, bool profiling)
+{
+    try {
+        init(device, profiling);
+    }
+    catch (...) {
+        release();
+        throw;
+    }
+}
+
+Context::~Context()
+{
+    release();
+}
+
+//~~~~~ Initialize platform, device, context and command queue ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Profiling is enabled by the constructor flag or by setting the OPENCL_PROFILE environment variable
+
+void Context::init(const DeviceInfo& device, bool profiling)
+{
+    const char* profileEnv = getenv("OPENCL_PROFILE");
+    _profiling = profiling || (profileEnv && *profileEnv && strcmp(profileEnv, "0") != 0);
+
+    // Platform and device come from the device selection
+    _info = device;
+    _platform = device.platform;
+    _device = device.device;
+
+    // Create context
+    cl_int err;
+    _context = clCreateContext(NULL, 1, &_device, NULL, NULL, &err);
+    checkError(err, "clCreateContext");
+
+    // Create command queue
+    cl_queue_properties queueProps[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+    _queue = clCreateCommandQueueWithProperties(_context, _device, _profiling ? queueProps : NULL, &err);
+    checkError(err, "clCreateCommandQueueWithProperties");
+
+    // Device memory limit for the buffer pool
+    _poolStats.limitBytes = (size_t)(_info.globalMemSize / 2);
+}
+
+//~~~~~ Release OpenCL resources ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Context::release()
+{
+    _namedBuffers.clear();
+    trimBufferPool();
+    if (_transferQueue) clReleaseCommandQueue(_transferQueue);
+    if (_queue)   clReleaseCommandQueue(_queue);
+    if (_context) clReleaseContext(_context);
+    _transferQueue = _queue = nullptr;
+    _context = nullptr;
+}
+
+//~~~~~ Get queue for transfers that overlap kernels, created on first use ~~~~~~~~~~~~~~~~~~~~~~~
+
+cl_command_queue Context::transferQueue()
+{
+    if (!_transferQueue)
+    {
+        cl_int err;
+        cl_queue_properties queueProps[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+        _transferQueue = clCreateCommandQueueWithProperties(_context, _device, _profiling ? queueProps : NULL, &err);
+        checkError(err, "clCreateCommandQueueWithProperties");
+    }
+    return _transferQueue;
+}
+
+//~~~~~ Wait for all enqueued commands ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Context::finish()
+{
+    checkError(clFinish(_queue), "clFinish");
+    if (_transferQueue) checkError(clFinish(_transferQueue), "clFinish");
+}
+
+/**************************************************************************************************
+ * OpenCL buffer pool
+ *
+ * Freed buffers are returned to a pool bucketed by size and flags, and are reused by later
+ * requests instead of allocating new device memory. Every released buffer advances the memory
+ * epoch, so kernels know that a bound buffer handle may now name a different buffer.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Round buffer size up to its pool bucket ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Buckets are spaced 1/8 of a power of two apart, so a reused buffer wastes at most 12.5%.
+// Requests that would not fit into the device allocation limit after rounding keep their size.
+
+size_t Context::poolBucketSize(size_t bytes) const
+{
+    const size_t minBucket = 4096;
+    if (bytes <= minBucket) return minBucket;
+    size_t step = 1;
+    while (step * 16 <= bytes) step <<= 1;
+    size_t bucket = (bytes + step - 1) / step * step;
+    if (_info.maxAllocSize && bucket > _info.maxAllocSize) bucket = bytes;
+    return bucket;
+}
+
+//~~~~~ Get buffer from the pool or allocate a new one ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+Context::Buffer Context::acquireBuffer(cl_mem_flags flags, size_t bytes)
+{
+    Buffer buffer;
+    buffer.flags = flags;
+    buffer.bytes = poolBucketSize(bytes);
+
+    auto it = _pool.find({ flags, buffer.bytes });
+    if (it != _pool.end())
+    {
+        buffer.mem = it->second;
+        _pool.erase(it);
+        _poolStats.pooledBytes -= buffer.bytes;
+        _poolStats.hits++;
+        return buffer;
+    }
+
+    cl_int err;
+    buffer.mem = clCreateBuffer(_context, flags, buffer.bytes, NULL, &err);
+    checkError(err, "clCreateBuffer");
+    _poolStats.misses++;
+    return buffer;
+}
+
+//~~~~~ Return buffer to the pool or release it above the high-water mark ~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Context::recycleBuffer(const Buffer& buffer)
+{
+    if (!buffer.mem) return;
+    if (!buffer.pooled)
+    {
+        releaseMem(buffer.mem);
+        return;
+    }
+    if (_poolStats.pooledBytes + buffer.bytes > _poolStats.limitBytes)
+    {
+        releaseMem(buffer.mem);
+        _poolStats.evictions++;
+        return;
+    }
+    _pool.insert({ { buffer.flags, buffer.bytes }, buffer.mem });
+    _poolStats.pooledBytes += buffer.bytes;
+}
+
+//~~~~~ Release buffer and advance the memory epoch ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// A new buffer may get the handle of a released one, so kernel bindings of older handles must not be reused
+
+void Context::releaseMem(cl_mem mem)
+{
+    clReleaseMemObject(mem);
+    _memoryEpoch++;
+}
+
+//~~~~~ Set the pool high-water mark and release everything above it ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Context::setBufferPoolLimit(size_t bytes)
+{
+    _poolStats.limitBytes = bytes;
+    while (_poolStats.pooledBytes > _poolStats.limitBytes && !_pool.empty())
+    {
+        auto it = std::prev(_pool.end()); // largest buckets go first
+        releaseMem(it->second);
+        _poolStats.pooledBytes -= it->first.second;
+        _poolStats.evictions++;
+        _pool.erase(it);
+    }
+}
+
+//~~~~~ Release all idle pooled buffers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Context::trimBufferPool()
+{
+    for (const auto& entry : _pool) releaseMem(entry.second);
+    _pool.clear();
+    _poolStats.pooledBytes = 0;
+}
+
+/**************************************************************************************************
+ * OpenCL device buffers
+ *
+ * Device buffers are allocated from the buffer pool and stay on the device until they are
+ * destroyed. They are not tied to kernel argument positions: a kernel binds a device buffer
+ * wherever it appears in its argument list, so stages of a pipeline exchange data on the device.
+ * Named buffers are kept by the context until erased or until the context is destroyed. A buffer
+ * refers to its context weakly, so one that outlives the context releases its memory object
+ * directly, which is valid as the memory object keeps its own reference to the OpenCL context.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Move device buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+DeviceBuffer& DeviceBuffer::operator=(DeviceBuffer&& other) noexcept
+{
+    if (this == &other) return *this;
+    reset();
+    _owner = std::move(other._owner);
+    _mem = other._mem;
+    _flags = other._flags;
+    _capacity = other._capacity;
+    _bytes = other._bytes;
+    _name = std::move(other._name);
+    other._owner.reset();
+    other._mem = nullptr;
+    other._capacity = other._bytes = 0;
+    return *this;
+}
+
+//~~~~~ Return device buffer memory to the pool ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void DeviceBuffer::reset()
+{
+    if (_mem)
+    {
+        std::shared_ptr<Context> owner = _owner.lock();
+        Context::Buffer buffer;
+        buffer.mem = _mem;
+        buffer.flags = _flags;
+        buffer.bytes = _capacity;
+        if (owner) owner->recycleBuffer(buffer);
+        else clReleaseMemObject(_mem);             // the context is gone, so is its pool
+    }
+    _owner.reset();
+    _mem = nullptr;
+    _capacity = _bytes = 0;
+}
+
+//~~~~~ Allocate device buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+DeviceBuffer Context::allocateBytes(const std::string& name, size_t bytes)
+{
+    if (!bytes) throw OpenClError("Device buffer " + name + " must not be empty");
+    Buffer buffer = acquireBuffer(CL_MEM_READ_WRITE, bytes);
+    DeviceBuffer result;
+    result._owner = weak_from_this();
+    result._mem = buffer.mem;
+    result._flags = buffer.flags;
+    result._capacity = buffer.bytes;
+    result._bytes = bytes;
+    result._name = name;
+    return result;
+}
+
+//~~~~~ Get named device buffer, created or resized as needed ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+DeviceBuffer& Context::namedBuffer(const std::string& name, size_t bytes)
+{
+    auto it = _namedBuffers.find(name);
+    if (it != _namedBuffers.end() && it->second.bytes() == bytes) return it->second;
+    if (it != _namedBuffers.end()) _namedBuffers.erase(it);
+    return _namedBuffers.emplace(name, allocateBytes(name, bytes)).first->second;
+}
+
+DeviceBuffer& Context::buffer(const std::string& name)
+{
+    auto it = _namedBuffers.find(name);
+    if (it == _namedBuffers.end()) throw OpenClError("Device buffer " + name + " not found");
+    return it->second;
+}
+
+/**************************************************************************************************
+ * OpenCL program and binary cache
+ *
+ * Built program binaries are stored on disk in the directory given by the OPENCL_CACHE_DIR
+ * environment variable (./clcache by default, caching is disabled when it is set to an empty
+ * string). An entry is keyed by a hash of the kernel source, the name and driver version of every
+ * device and the build options, and holds one binary per device. A stale or corrupt entry is
+ * removed and the program is compiled from source.
+ *
+ **************************************************************************************************/
+
+static const char PROGRAM_CACHE_MAGIC[8] = { 'C', 'L', 'B', 'I', 'N', 0, 0, 1 };
+
+//~~~~~ FNV-1a hash for cache keys ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static unsigned long long fnv1a(const std::string& data, unsigned long long hash = 14695981039346656037ULL)
+{
+    for (unsigned char c : data) { hash ^= c; hash *= 1099511628211ULL; }
+    return hash;
+}
+
+//~~~~~ Build options string ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+std::string BuildOptions::str() const
+{
+    std::string options;
+    for (const auto& flag : _flags) options += (options.empty() ? "" : " ") + flag;
+    for (const auto& define : _defines)
+    {
+        options += (options.empty() ? "-D" : " -D") + define.first;
+        if (!define.second.empty()) options += "=" + define.second;
+    }
+    return options;
+}
+
+//~~~~~ Constructor and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+Program::Program(std::shared_ptr<Context> context, const std::string& kernelSourceFile, const BuildOptions& buildOptions)
+    : _context(std::move(context)), _options(buildOptions.str())
+{
+    if (!_context) throw OpenClError("Program needs a context");
+    build(loadSource(kernelSourceFile), _options);
+}
+
+Program::Program(std::shared_ptr<Context> context)
+    : _context(std::move(context))
+{
+    if (!_context) throw OpenClError("Program needs a context");
+}
+
+// Program from kernel source text, for kernels that ship inside the library instead of a .cl file
+
+std::shared_ptr<Program> Program::fromSource(std::shared_ptr<Context> context, const std::string& source, const BuildOptions& buildOptions)
+{
+    std::shared_ptr<Program> program(new Program(std::move(context)));
+    program->_options = buildOptions.str();
+    program->build(source, program->_options);
+    return program;
+}
+
+Program::~Program()
+{
+    if (_program) clReleaseProgram(_program);
+}
+
+//~~~~~ Load kernel source from file ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+std::string Program::loadSource(const std::string& filename)
+{
+    FILE* file = fopen(filename.c_str(), "r");
+    if (!file) throw OpenClError("Failed to load kernel file");
+    fseek(file, 0, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    std::string source(fileSize, '\0');
+    source.resize(fread(&source[0], 1, fileSize, file));
+    fclose(file);
+    return source;
+}
+
+//~~~~~ Build program from cache or from source ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Program::build(const std::string& source, const std::string& options)
+{
+    Timer timer;
+    _program = buildProgram(_context->context(), { _context->device() }, source, options, &_cached);
+    _buildTime = timer.ms();
+}
+
+//~~~~~ Program variant cache ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+ProgramCache::ProgramCache(std::shared_ptr<Context> context, size_t capacity)
+    : _context(std::move(context)), _capacity(capacity ? capacity : 1)
+{
+    if (!_context) throw OpenClError("Program cache needs a context");
+}
+
+// A miss builds the variant, which still goes through the on-disk binary cache
+
+std::shared_ptr<Program> ProgramCache::get(const std::string& kernelSourceFile, const BuildOptions& buildOptions)
+{
+    std::string key = kernelSourceFile + "\n" + buildOptions.str();
+    for (auto it = _entries.begin(); it != _entries.end(); ++it)
+    {
+        if (it->first != key) continue;
+        _stats.hits++;
+        _entries.splice(_entries.begin(), _entries, it);
+        return it->second;
+    }
+
+    _stats.misses++;
+    auto program = std::make_shared<Program>(_context, kernelSourceFile, buildOptions);
+    _entries.emplace_front(key, program);
+    while (_entries.size() > _capacity) { _entries.pop_back(); _stats.evictions++; }
+    return program;
+}
+
+//~~~~~ Get build logs of all devices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static std::string buildLog(cl_program program, const std::vector<cl_device_id>& devices)
+{
+    std::string logs;
+    for (cl_device_id device : devices)
+    {
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+        std::string log(logSize, '\0');
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
+        if (devices.size() > 1)
+        {
+            char deviceName[256]{};
+            clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, NULL);
+            logs += std::string("\n") + deviceName + ":\n";
+        }
+        logs += log;
+    }
+    return logs;
+}
+
+//~~~~~ Get cache file path for kernel source, devices and build options ~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static std::string cachePath(const std::vector<cl_device_id>& devices, const std::string& source, const std::string& options)
+{
+    const char* env = getenv("OPENCL_CACHE_DIR");
+    std::string dir = env ? env : "./clcache";
+    if (dir.empty()) return "";
+    mkdir(dir.c_str(), 0755);
+
+    unsigned long long hash = fnv1a(source);
+    for (cl_device_id device : devices)
+    {
+        char deviceName[256]{}, driverVersion[256]{};
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, NULL);
+        clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, NULL);
+        hash = fnv1a(std::string("\n") + deviceName, hash);
+        hash = fnv1a(std::string("\n") + driverVersion, hash);
+    }
+    hash = fnv1a(std::string("\n") + options, hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", hash);
+    return dir + name;
+}
+
+//~~~~~ Load program binaries from cache, nullptr if missing or unusable ~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// An entry holds one binary per device in device order, each preceded by its size
+
+static cl_program loadBinary(cl_context context, const std::vector<cl_device_id>& devices, const std::string& path, const std::string& options)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return nullptr;
+
+    char magic[sizeof(PROGRAM_CACHE_MAGIC)];
+    std::vector<std::vector<unsigned char>> binaries(devices.size());
+    bool valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+        && memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) == 0;
+    for (auto& binary : binaries)
+    {
+        unsigned long long size = 0;
+        valid = valid && fread(&size, sizeof(size), 1, file) == 1 && size > 0 && size < (1ULL << 31);
+        if (!valid) break;
+        binary.resize(size);
+        valid = fread(binary.data(), 1, size, file) == size;
+    }
+    valid = valid && fgetc(file) == EOF;
+    fclose(file);
+
+    cl_program program = nullptr;
+    if (valid)
+    {
+        cl_int err;
+        std::vector<cl_int> status(devices.size(), CL_SUCCESS);
+        std::vector<const unsigned char*> data;
+        std::vector<size_t> lengths;
+        for (const auto& binary : binaries) { data.push_back(binary.data()); lengths.push_back(binary.size()); }
+        program = clCreateProgramWithBinary(context, (cl_uint)devices.size(), devices.data(), lengths.data(), data.data(), status.data(), &err);
+        valid = err == CL_SUCCESS && std::all_of(status.begin(), status.end(), [](cl_int s) { return s == CL_SUCCESS; })
+            && clBuildProgram(program, (cl_uint)devices.size(), devices.data(), options.c_str(), NULL, NULL) == CL_SUCCESS;
+    }
+    if (!valid)
+    {
+        if (program) clReleaseProgram(program);
+        program = nullptr;
+        remove(path.c_str());
+    }
+    return program;
+}
+
+//~~~~~ Save built program binaries to cache ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// The binaries are written to a temporary file and renamed, so concurrent jobs never see a partial
+// entry. Failing to write the cache is not an error.
+
+static void saveBinary(cl_program program, size_t deviceCount, const std::string& path)
+{
+    std::vector<size_t> sizes(deviceCount);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * deviceCount, sizes.data(), NULL) != CL_SUCCESS) return;
+    std::vector<std::vector<unsigned char>> binaries(deviceCount);
+    std::vector<unsigned char*> data;
+    for (size_t i = 0; i < deviceCount; i++)
+    {
+        if (sizes[i] == 0) return;
+        binaries[i].resize(sizes[i]);
+        data.push_back(binaries[i].data());
+    }
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * deviceCount, data.data(), NULL) != CL_SUCCESS) return;
+
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file) return;
+    bool written = fwrite(PROGRAM_CACHE_MAGIC, 1, sizeof(PROGRAM_CACHE_MAGIC), file) == sizeof(PROGRAM_CACHE_MAGIC);
+    for (const auto& binary : binaries)
+    {
+        unsigned long long length = binary.size();
+        written = written && fwrite(&length, sizeof(length), 1, file) == 1
+            && fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+    }
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) remove(tmpPath.c_str());
+}
+
+//~~~~~ Build program for devices of a context, from cache or from source ~~~~~~~~~~~~~~~~~~~~~~~~
+
+cl_program buildProgram(cl_context context, const std::vector<cl_device_id>& devices, const std::string& source, const std::string& options, bool* cached)
+{
+    std::string path = cachePath(devices, source, options);
+    cl_program program = path.empty() ? nullptr : loadBinary(context, devices, path, options);
+    if (cached) *cached = program != nullptr;
+    if (program) return program;
+
+    cl_int err;
+    const char* text = source.c_str();
+    program = clCreateProgramWithSource(context, 1, &text, NULL, &err);
+    checkError(err, "clCreateProgramWithSource");
+
+    err = clBuildProgram(program, (cl_uint)devices.size(), devices.data(), options.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        std::string log = buildLog(program, devices);
+        clReleaseProgram(program);
+        throw OpenClError("Build error" + log);
+    }
+
+    if (!path.empty()) saveBinary(program, devices.size(), path);
+    return program;
+}
+
+/**************************************************************************************************
+ * OpenCL kernel
+ *
+ * A kernel remembers the last value bound to each argument slot (scalar bytes, buffer handle or
+ * __local size) and skips clSetKernelArg when the same value is bound again. Buffer handles are
+ * compared together with the context memory epoch at binding time.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Constructor, destructor and move ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+Kernel::Kernel(std::shared_ptr<Program> program, const std::string& name)
+    : _program(std::move(program)), _name(name)
+{
+    cl_int err;
+    _kernel = clCreateKernel(_program->program(), name.c_str(), &err);
+    checkError(err, "clCreateKernel");
+
+    cl_uint numArgs = 0;
+    err = clGetKernelInfo(_kernel, CL_KERNEL_NUM_ARGS, sizeof(numArgs), &numArgs, NULL);
+    if (err != CL_SUCCESS) clReleaseKernel(_kernel);
+    checkError(err, "clGetKernelInfo");
+    _args.resize(numArgs);
+}
+
+Kernel::~Kernel()
+{
+    if (_kernel) clReleaseKernel(_kernel);
+}
+
+Kernel::Kernel(Kernel&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+Kernel& Kernel::operator=(Kernel&& other) noexcept
+{
+    if (this == &other) return *this;
+    if (_kernel) clReleaseKernel(_kernel);
+    _program = std::move(other._program);
+    _kernel = other._kernel;
+    _name = std::move(other._name);
+    _args = std::move(other._args);
+    _bound = other._bound;
+    other._kernel = nullptr;
+    other._bound = 0;
+    return *this;
+}
+
+//~~~~~ Get maximum work-group size for kernel on the device ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t Kernel::workGroupSize() const
+{
+    size_t size = 0;
+    cl_int err = clGetKernelWorkGroupInfo(_kernel, _program->context()->device(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(size), &size, NULL);
+    checkError(err, "clGetKernelWorkGroupInfo");
+    return size;
+}
+
+//~~~~~ Get preferred work-group size multiple for kernel on the device ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t Kernel::preferredWorkGroupMultiple() const
+{
+    size_t multiple = 0;
+    cl_int err = clGetKernelWorkGroupInfo(_kernel, _program->context()->device(), CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+    checkError(err, "clGetKernelWorkGroupInfo");
+    return multiple;
+}
+
+//~~~~~ Set argument unless the slot already holds the same value, true if the driver was called ~~~
+
+// value is NULL for __local arguments, epoch is the context memory epoch for buffer handles and 0 otherwise
+
+bool Kernel::setArg(cl_uint index, size_t size, const void* value, unsigned long long epoch)
+{
+    if (index >= _args.size()) throw OpenClError("Kernel " + _name + " has no argument " + std::to_string(index));
+    BoundArg& slot = _args[index];
+
+    bool cacheable = size <= sizeof(slot.value);
+    if (slot.bound && cacheable && slot.size == size && slot.local == !value && slot.epoch == epoch
+        && (!value || !memcmp(slot.value, value, size))) return false;
+
+    checkError(clSetKernelArg(_kernel, index, size, value), "clSetKernelArg");
+
+    if (!slot.bound) _bound++;
+    slot.bound = true;
+    slot.local = !value;
+    slot.size = size;
+    slot.epoch = epoch;
+    if (value && cacheable) memcpy(slot.value, value, size);
+    else if (value) slot.size = SIZE_MAX;       // too large to compare, always rebound
+    return true;
+}
+
+//~~~~~ Distinct buffer handles bound to the arguments ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+std::vector<cl_mem> Kernel::boundBuffers() const
+{
+    std::vector<cl_mem> buffers;
+    for (const auto& arg : _args)
+    {
+        if (!arg.bound || !arg.epoch || arg.size != sizeof(cl_mem)) continue;
+        cl_mem mem;
+        memcpy(&mem, arg.value, sizeof(cl_mem));
+        if (mem && std::find(buffers.begin(), buffers.end(), mem) == buffers.end()) buffers.push_back(mem);
+    }
+    return buffers;
+}
+
+//~~~~~ Forget bound arguments, so the next launch sets all of them ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Kernel::unbind()
+{
+    for (auto& arg : _args) arg.bound = false;
+    _bound = 0;
+}
@@ -0,0 +1,265 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <CL/cl.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <list>
+#include <memory>
+#include <utility>
+#include "device.h"
+
+class OpenClError : public std::runtime_error {
+public:
+    OpenClError(cl_int err, const std::string& operation);
+    OpenClError(const std::string& message);
+};
+
+inline void checkError(cl_int err, const std::string& operation)
+{
+    if (err != CL_SUCCESS) throw OpenClError(err, operation);
+}
+
+struct BufferPoolStats {
+    size_t hits = 0;         // buffer requests served from the pool
+    size_t misses = 0;       // buffer requests that needed clCreateBuffer
+    size_t evictions = 0;    // buffers released because the pool was above its limit
+    size_t pooledBytes = 0;  // bytes currently held idle in the pool
+    size_t limitBytes = 0;   // high-water mark for idle pooled bytes
+};
+
+class Context;
+
+// Named buffer in device memory that lives independently of kernel argument lists. Any kernel can
+// bind it at any position, so the output of one kernel feeds the input of another without a host
+// round trip. The memory returns to the pool of the owning context on destruction, or is released
+// directly when the context is already gone (or was not created through a shared_ptr)
+
+class DeviceBuffer {
+private:
+    friend class Context;
+    std::weak_ptr<Context> _owner{};
+    cl_mem _mem = nullptr;
+    cl_mem_flags _flags = 0;
+    size_t _capacity = 0;    // size of the pooled allocation
+    size_t _bytes = 0;       // requested size
+    std::string _name{};
+
+public:
+    DeviceBuffer() = default;
+    DeviceBuffer(DeviceBuffer&& other) noexcept { *this = std::move(other); }
+    DeviceBuffer& operator=(DeviceBuffer&& other) noexcept;
+    DeviceBuffer(const DeviceBuffer&) = delete;
+    DeviceBuffer& operator=(const DeviceBuffer&) = delete;
+    ~DeviceBuffer() { reset(); }
+
+    void reset();
+    cl_mem mem() const { return _mem; }
+    size_t bytes() const { return _bytes; }
+    const std::string& name() const { return _name; }
+    explicit operator bool() const { return _mem != nullptr; }
+};
+
+// Platform, device, OpenCL context, command queues and device memory shared by any number of
+// programs and jobs, e.g. auto context = Context::create(); OpenCL sum(context, "sum.cl", "sum");
+// The device is chosen by selectDevice, so Context::create(false, "cpu") runs on a CPU runtime
+
+class Context : public std::enable_shared_from_this<Context> {
+public:
+    struct Buffer {
+        cl_mem mem = nullptr;
+        cl_mem_flags flags = 0;
+        size_t bytes = 0;
+        bool pooled = true;
+    };
+
+private:
+    cl_platform_id _platform = 0;
+    cl_device_id _device = 0;
+    DeviceInfo _info{};
+    cl_context _context = nullptr;
+    cl_command_queue _queue = nullptr;
+    cl_command_queue _transferQueue = nullptr;
+    bool _profiling = false;
+    std::multimap<std::pair<cl_mem_flags, size_t>, cl_mem> _pool{};
+    BufferPoolStats _poolStats{};
+    unsigned long long _memoryEpoch = 1;
+    std::map<std::string, DeviceBuffer> _namedBuffers{};
+
+    void init(const DeviceInfo& device, bool profiling);
+    void release();
+    size_t poolBucketSize(size_t bytes) const;
+    void releaseMem(cl_mem mem);
+    DeviceBuffer allocateBytes(const std::string& name, size_t bytes);
+    DeviceBuffer& namedBuffer(const std::string& name, size_t bytes);
+
+public:
+    explicit Context(bool profiling = false, const std::string& device = "");
+    explicit Context(const DeviceInfo& device, bool profiling = false);
+    ~Context();
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+    static std::shared_ptr<Context> create(bool profiling = false, const std::string& device = "") {
+        return std::make_shared<Context>(profiling, device);
+    }
+    static std::shared_ptr<Context> create(const DeviceInfo& device, bool profiling = false) {
+        return std::make_shared<Context>(device, profiling);
+    }
+
+    cl_platform_id platform() const { return _platform; }
+    cl_device_id device() const { return _device; }
+    cl_context context() const { return _context; }
+    cl_command_queue queue() const { return _queue; }
+    cl_command_queue transferQueue();
+    bool profiling() const { return _profiling; }
+    const DeviceInfo& deviceInfo() const { return _info; }
+    bool unifiedMemory() const { return _info.unifiedMemory; }
+    size_t maxAllocSize() const { return (size_t)_info.maxAllocSize; }
+    void finish();
+
+    // Buffer pool, buffers are bucketed by flags and size and reused instead of allocated again
+
+    Buffer acquireBuffer(cl_mem_flags flags, size_t bytes);
+    void recycleBuffer(const Buffer& buffer);
+    void setBufferPoolLimit(size_t bytes);
+    void trimBufferPool();
+    const BufferPoolStats& bufferPoolStats() const { return _poolStats; }
+    unsigned long long memoryEpoch() const { return _memoryEpoch; }
+
+    // Device buffers, named ones are kept by the context and shared by all of its jobs
+
+    template<class T> DeviceBuffer allocate(const std::string& name, size_t count) { return allocateBytes(name, sizeof(T) * count); }
+    template<class T> DeviceBuffer& buffer(const std::string& name, size_t count) { return namedBuffer(name, sizeof(T) * count); }
+    DeviceBuffer& buffer(const std::string& name);
+    bool hasBuffer(const std::string& name) const { return _namedBuffers.count(name) > 0; }
+    void eraseBuffer(const std::string& name) { _namedBuffers.erase(name); }
+};
+
+// Program build options: compiler flags and -D defines kept sorted, so that equal sets give the same
+// option string and hit the same cached program, e.g. BuildOptions().define("DIM", 1000).madEnable()
+
+class BuildOptions {
+private:
+    std::set<std::string> _flags{};
+    std::map<std::string, std::string> _defines{};
+
+public:
+    BuildOptions() = default;
+    BuildOptions(const std::string& options) { if (!options.empty()) _flags.insert(options); }
+    BuildOptions(const char* options) : BuildOptions(std::string(options)) {}
+
+    BuildOptions& flag(const std::string& option) { if (!option.empty()) _flags.insert(option); return *this; }
+    BuildOptions& define(const std::string& name, const std::string& value = "") { _defines[name] = value; return *this; }
+    BuildOptions& define(const std::string& name, const char* value) { return define(name, std::string(value)); }
+    template<class T> BuildOptions& define(const std::string& name, T value) { return define(name, std::to_string(value)); }
+    BuildOptions& fastRelaxedMath() { return flag("-cl-fast-relaxed-math"); }
+    BuildOptions& madEnable() { return flag("-cl-mad-enable"); }
+
+    std::string str() const;
+};
+
+// OpenCL program of source text built for devices of an OpenCL context, loaded from the binary
+// cache when possible (cached tells which). A failed build throws with the log of every device
+
+cl_program buildProgram(cl_context context, const std::vector<cl_device_id>& devices, const std::string& source,
+    const std::string& options, bool* cached = nullptr);
+
+// Program built from a kernel source file against a context, loaded from the binary cache when possible
+
+class Program {
+private:
+    std::shared_ptr<Context> _context;
+    cl_program _program = nullptr;
+    std::string _options{};
+    bool _cached = false;
+    double _buildTime = 0;
+
+    void build(const std::string& source, const std::string& options);
+    explicit Program(std::shared_ptr<Context> context);
+
+public:
+    static std::string loadSource(const std::string& filename);
+    Program(std::shared_ptr<Context> context, const std::string& kernelSourceFile, const BuildOptions& buildOptions = {});
+    static std::shared_ptr<Program> fromSource(std::shared_ptr<Context> context, const std::string& source, const BuildOptions& buildOptions = {});
+    ~Program();
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    const std::shared_ptr<Context>& context() const { return _context; }
+    cl_program program() const { return _program; }
+    const std::string& options() const { return _options; }
+    bool fromCache() const { return _cached; }
+    double buildTime() const { return _buildTime; }
+};
+
+// Specialised program variants of one context, keyed by kernel source file and build options and
+// kept in memory for the least recently used order, e.g. cache.get("mul.cl", BuildOptions().define("DIM", n))
+
+struct ProgramCacheStats {
+    size_t hits = 0;         // variants returned from memory
+    size_t misses = 0;       // variants built or loaded from the binary cache
+    size_t evictions = 0;    // variants dropped because the cache was full
+};
+
+class ProgramCache {
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<Program>>;
+
+    std::shared_ptr<Context> _context;
+    size_t _capacity;
+    std::list<Entry> _entries{};     // most recently used first
+    ProgramCacheStats _stats{};
+
+public:
+    explicit ProgramCache(std::shared_ptr<Context> context, size_t capacity = 8);
+
+    std::shared_ptr<Program> get(const std::string& kernelSourceFile, const BuildOptions& buildOptions = {});
+    void clear() { _entries.clear(); }
+    size_t size() const { return _entries.size(); }
+    const std::shared_ptr<Context>& context() const { return _context; }
+    const ProgramCacheStats& stats() const { return _stats; }
+};
+
+// Kernel of a program with the last value bound to each argument slot, so that binding an
+// equal value again does not call the driver
+
+class Kernel {
+private:
+    struct BoundArg {
+        bool bound = false;
+        bool local = false;
+        size_t size = 0;
+        unsigned long long epoch = 0;   // context memory epoch of a bound buffer handle
+        unsigned char value[8] = {};
+    };
+
+    std::shared_ptr<Program> _program{};
+    cl_kernel _kernel = nullptr;
+    std::string _name{};
+    std::vector<BoundArg> _args{};
+    cl_uint _bound = 0;
+
+public:
+    Kernel(std::shared_ptr<Program> program, const std::string& name);
+    ~Kernel();
+    Kernel(Kernel&& other) noexcept;
+    Kernel& operator=(Kernel&& other) noexcept;
+    Kernel(const Kernel&) = delete;
+    Kernel& operator=(const Kernel&) = delete;
+
+    cl_kernel kernel() const { return _kernel; }
+    const std::string& name() const { return _name; }
+    cl_uint numArgs() const { return (cl_uint)_args.size(); }
+    size_t workGroupSize() const;
+    size_t preferredWorkGroupMultiple() const;
+
+    bool setArg(cl_uint index, size_t size, const void* value, unsigned long long epoch = 0);
+    bool bound() const { return _bound == _args.size(); }
+    std::vector<cl_mem> boundBuffers() const;
+    void unbind();
+};
+
+#endif // CONTEXT_H
@@ -0,0 +1,145 @@
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <immintrin.h>
+#include "cpugemm.h"
+
+/**************************************************************************************************
+ * Blocked CPU matrix multiplication
+ *
+ * B is packed into panels of NR columns stored k-major (panel[k][0..NR-1]), so the inner kernel
+ * reads it with unit stride. The product is computed in MR x NR tiles of C held in registers,
+ * looping over KC-deep slices of k so that the A rows and the B panel slice stay in cache.
+ * Threads own disjoint blocks of MC rows of C.
+ *
+ **************************************************************************************************/
+
+const size_t MR = 4;    // rows of C per micro tile
+const size_t NR = 16;   // columns of C per micro tile (two AVX2 vectors)
+const size_t KC = 256;  // depth of k slice
+const size_t MC = 64;   // rows of C per thread block
+
+//~~~~~ Micro kernel with AVX2 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Accumulates a full MR x NR tile: c[r][j] += sum(a[r][k] * panel[k][j]) for k in [0, kc)
+
+__attribute__((target("avx2")))
+static void microKernelAvx2(const int* a, size_t lda, const int* panel, size_t kc, int* c, size_t ldc)
+{
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+
+    for (size_t k = 0; k < kc; k++)
+    {
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(panel + k * NR));
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(panel + k * NR + 8));
+        __m256i a0 = _mm256_set1_epi32(a[0 * lda + k]);
+        __m256i a1 = _mm256_set1_epi32(a[1 * lda + k]);
+        __m256i a2 = _mm256_set1_epi32(a[2 * lda + k]);
+        __m256i a3 = _mm256_set1_epi32(a[3 * lda + k]);
+        c00 = _mm256_add_epi32(c00, _mm256_mullo_epi32(a0, b0)); c01 = _mm256_add_epi32(c01, _mm256_mullo_epi32(a0, b1));
+        c10 = _mm256_add_epi32(c10, _mm256_mullo_epi32(a1, b0)); c11 = _mm256_add_epi32(c11, _mm256_mullo_epi32(a1, b1));
+        c20 = _mm256_add_epi32(c20, _mm256_mullo_epi32(a2, b0)); c21 = _mm256_add_epi32(c21, _mm256_mullo_epi32(a2, b1));
+        c30 = _mm256_add_epi32(c30, _mm256_mullo_epi32(a3, b0)); c31 = _mm256_add_epi32(c31, _mm256_mullo_epi32(a3, b1));
+    }
+
+    __m256i* row;
+    row = (__m256i*)(c + 0 * ldc); _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row), c00)); _mm256_storeu_si256(row + 1, _mm256_add_epi32(_mm256_loadu_si256(row + 1), c01));
+    row = (__m256i*)(c + 1 * ldc); _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row), c10)); _mm256_storeu_si256(row + 1, _mm256_add_epi32(_mm256_loadu_si256(row + 1), c11));
+    row = (__m256i*)(c + 2 * ldc); _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row), c20)); _mm256_storeu_si256(row + 1, _mm256_add_epi32(_mm256_loadu_si256(row + 1), c21));
+    row = (__m256i*)(c + 3 * ldc); _mm256_storeu_si256(row, _mm256_add_epi32(_mm256_loadu_si256(row), c30)); _mm256_storeu_si256(row + 1, _mm256_add_epi32(_mm256_loadu_si256(row + 1), c31));
+}
+
+//~~~~~ Portable micro kernel ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Accumulates an mr x nr edge tile (mr <= MR, nr <= NR), also used when AVX2 is not available
+
+static void microKernel(const int* a, size_t lda, const int* panel, size_t kc, int* c, size_t ldc, size_t mr, size_t nr)
+{
+    int acc[MR][NR]{};
+    for (size_t k = 0; k < kc; k++)
+    {
+        const int* bk = panel + k * NR;
+        for (size_t r = 0; r < mr; r++)
+        {
+            int ak = a[r * lda + k];
+            for (size_t j = 0; j < NR; j++) acc[r][j] += ak * bk[j];
+        }
+    }
+    for (size_t r = 0; r < mr; r++)
+        for (size_t j = 0; j < nr; j++) c[r * ldc + j] += acc[r][j];
+}
+
+//~~~~~ Pack columns [j0, j0 + NR) of B into a k-major panel, zero padded ~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static void packPanel(const int* b, size_t dim, size_t j0, int* panel)
+{
+    size_t nr = std::min(NR, dim - j0);
+    for (size_t k = 0; k < dim; k++)
+    {
+        memcpy(panel + k * NR, b + k * dim + j0, nr * sizeof(int));
+        for (size_t j = nr; j < NR; j++) panel[k * NR + j] = 0;
+    }
+}
+
+//~~~~~ Multiply rows [r0, r1) of A by packed B ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static void gemmRows(const int* a, const int* packed, int* c, size_t dim, size_t r0, size_t r1, bool avx2)
+{
+    size_t panels = (dim + NR - 1) / NR;
+    memset(c + r0 * dim, 0, (r1 - r0) * dim * sizeof(int));
+
+    for (size_t k0 = 0; k0 < dim; k0 += KC)
+    {
+        size_t kc = std::min(KC, dim - k0);
+        for (size_t p = 0; p < panels; p++)
+        {
+            const int* panel = packed + p * dim * NR + k0 * NR;
+            size_t j0 = p * NR, nr = std::min(NR, dim - j0);
+            for (size_t r = r0; r < r1; r += MR)
+            {
+                size_t mr = std::min(MR, r1 - r);
+                const int* ablock = a + r * dim + k0;
+                int* cblock = c + r * dim + j0;
+                if (avx2 && mr == MR && nr == NR) microKernelAvx2(ablock, dim, panel, kc, cblock, dim);
+                else microKernel(ablock, dim, panel, kc, cblock, dim, mr, nr);
+            }
+        }
+    }
+}
+
+//~~~~~ Multiply matrices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void cpuGemm(const int* a, const int* b, int* c, size_t dim, unsigned threads)
+{
+    if (dim == 0) return;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    bool avx2 = __builtin_cpu_supports("avx2");
+
+    size_t panels = (dim + NR - 1) / NR;
+    size_t blocks = (dim + MC - 1) / MC;
+    threads = (unsigned)std::min<size_t>(threads, std::max(panels, blocks));
+    std::vector<int> packed(panels * dim * NR);
+    std::vector<std::thread> pool;
+
+    // Pack B panels in parallel
+
+    for (unsigned t = 0; t < threads; t++)
+        pool.emplace_back([&, t]() {
+            for (size_t p = t; p < panels; p += threads) packPanel(b, dim, p * NR, packed.data() + p * dim * NR);
+        });
+    for (auto& thread : pool) thread.join();
+    pool.clear();
+
+    // Distribute row blocks over threads
+
+    for (unsigned t = 0; t < threads; t++)
+        pool.emplace_back([&, t]() {
+            for (size_t blk = t; blk < blocks; blk += threads)
+                gemmRows(a, packed.data(), c, dim, blk * MC, std::min(dim, (blk + 1) * MC), avx2);
+        });
+    for (auto& thread : pool) thread.join();
+}
@@ -0,0 +1,12 @@
+#ifndef CPUGEMM_H
+#define CPUGEMM_H
+
+#include <stddef.h>
+
+// Integer matrix multiplication on the CPU: c = a * b for square row-major dim x dim matrices.
+// B is packed into column panels once, the product is cache blocked, the inner kernel uses AVX2
+// when the CPU supports it, and row blocks are distributed over threads (0 = all hardware threads).
+
+void cpuGemm(const int* a, const int* b, int* c, size_t dim, unsigned threads = 0);
+
+#endif // CPUGEMM_H
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <limits>
+#include "device.h"
+#include "context.h"
+#include "timer.h"
+
+/**************************************************************************************************
+ * OpenCL device capabilities
+ *
+ * Devices of all platforms are enumerated and their properties are collected into DeviceInfo,
+ * so that selection policies and kernels can use them without repeated clGetDeviceInfo calls.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Query helpers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+template<class T> static T deviceValue(cl_device_id device, cl_device_info param)
+{
+    T value{};
+    clGetDeviceInfo(device, param, sizeof(value), &value, NULL);
+    return value;
+}
+
+static std::string deviceString(cl_device_id device, cl_device_info param)
+{
+    size_t size = 0;
+    if (clGetDeviceInfo(device, param, 0, NULL, &size) != CL_SUCCESS || size == 0) return "";
+    std::string value(size, '\0');
+    clGetDeviceInfo(device, param, size, &value[0], NULL);
+    value.resize(strlen(value.c_str()));
+    return value;
+}
+
+static std::string platformString(cl_platform_id platform, cl_platform_info param)
+{
+    size_t size = 0;
+    if (clGetPlatformInfo(platform, param, 0, NULL, &size) != CL_SUCCESS || size == 0) return "";
+    std::string value(size, '\0');
+    clGetPlatformInfo(platform, param, size, &value[0], NULL);
+    value.resize(strlen(value.c_str()));
+    return value;
+}
+
+static std::string lowerCase(std::string text)
+{
+    for (char& c : text) c = (char)tolower((unsigned char)c);
+    return text;
+}
+
+//~~~~~ Collect device capabilities ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+DeviceInfo queryDevice(cl_device_id device)
+{
+    DeviceInfo info;
+    info.device = device;
+    info.platform = deviceValue<cl_platform_id>(device, CL_DEVICE_PLATFORM);
+    info.platformName = platformString(info.platform, CL_PLATFORM_NAME);
+    info.name = deviceString(device, CL_DEVICE_NAME);
+    info.vendor = deviceString(device, CL_DEVICE_VENDOR);
+    info.version = deviceString(device, CL_DEVICE_VERSION);
+    info.driverVersion = deviceString(device, CL_DRIVER_VERSION);
+    info.type = deviceValue<cl_device_type>(device, CL_DEVICE_TYPE);
+    info.available = deviceValue<cl_bool>(device, CL_DEVICE_AVAILABLE);
+    info.compilerAvailable = deviceValue<cl_bool>(device, CL_DEVICE_COMPILER_AVAILABLE);
+    info.computeUnits = deviceValue<cl_uint>(device, CL_DEVICE_MAX_COMPUTE_UNITS);
+    info.clockMHz = deviceValue<cl_uint>(device, CL_DEVICE_MAX_CLOCK_FREQUENCY);
+    info.globalMemSize = deviceValue<cl_ulong>(device, CL_DEVICE_GLOBAL_MEM_SIZE);
+    info.globalCacheSize = deviceValue<cl_ulong>(device, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE);
+    info.localMemSize = deviceValue<cl_ulong>(device, CL_DEVICE_LOCAL_MEM_SIZE);
+    info.maxAllocSize = deviceValue<cl_ulong>(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+    info.memBaseAddrAlign = deviceValue<cl_uint>(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN);
+    info.maxWorkGroupSize = deviceValue<size_t>(device, CL_DEVICE_MAX_WORK_GROUP_SIZE);
+    cl_uint dims = deviceValue<cl_uint>(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS);
+    info.maxWorkItemSizes.resize(dims);
+    if (dims) clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, dims * sizeof(size_t), info.maxWorkItemSizes.data(), NULL);
+    info.preferredWidthChar = deviceValue<cl_uint>(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR);
+    info.preferredWidthShort = deviceValue<cl_uint>(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT);
+    info.preferredWidthInt = deviceValue<cl_uint>(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT);
+    info.preferredWidthLong = deviceValue<cl_uint>(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG);
+    info.preferredWidthFloat = deviceValue<cl_uint>(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT);
+    info.preferredWidthDouble = deviceValue<cl_uint>(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE);
+    info.unifiedMemory = deviceValue<cl_bool>(device, CL_DEVICE_HOST_UNIFIED_MEMORY);
+    info.extensions = deviceString(device, CL_DEVICE_EXTENSIONS);
+    return info;
+}
+
+//~~~~~ Enumerate devices of all platforms ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+std::vector<DeviceInfo> listDevices()
+{
+    std::vector<DeviceInfo> devices;
+    cl_uint numPlatforms = 0;
+    if (clGetPlatformIDs(0, NULL, &numPlatforms) != CL_SUCCESS || numPlatforms == 0) return devices;
+    std::vector<cl_platform_id> platforms(numPlatforms);
+    checkError(clGetPlatformIDs(numPlatforms, platforms.data(), NULL), "clGetPlatformIDs");
+
+    for (cl_uint p = 0; p < numPlatforms; p++)
+    {
+        cl_uint numDevices = 0;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices) != CL_SUCCESS || numDevices == 0) continue;
+        std::vector<cl_device_id> ids(numDevices);
+        checkError(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, numDevices, ids.data(), NULL), "clGetDeviceIDs");
+        for (cl_uint d = 0; d < numDevices; d++)
+        {
+            devices.push_back(queryDevice(ids[d]));
+            devices.back().platformIndex = (int)p;
+            devices.back().deviceIndex = (int)d;
+        }
+    }
+    return devices;
+}
+
+//~~~~~ Check for device extension ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool DeviceInfo::hasExtension(const std::string& extension) const
+{
+    size_t pos = 0;
+    while ((pos = extensions.find(extension, pos)) != std::string::npos)
+    {
+        size_t end = pos + extension.size();
+        if ((pos == 0 || extensions[pos - 1] == ' ') && (end == extensions.size() || extensions[end] == ' ')) return true;
+        pos = end;
+    }
+    return false;
+}
+
+//~~~~~ Get device type name ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+std::string DeviceInfo::typeName() const
+{
+    if (type & CL_DEVICE_TYPE_GPU) return "GPU";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR) return "accelerator";
+    if (type & CL_DEVICE_TYPE_CPU) return "CPU";
+    return "other";
+}
+
+//~~~~~ Estimate device throughput from compute units, clock and vector width ~~~~~~~~~~~~~~~~~~~~
+
+// GPU compute units run many lanes each, so they are weighted higher than CPU cores
+
+double DeviceInfo::score() const
+{
+    double lanes = (type & CL_DEVICE_TYPE_GPU) ? 64 : std::max<cl_uint>(preferredWidthFloat, 1);
+    return computeUnits * (double)clockMHz * lanes;
+}
+
+//~~~~~ Print device capabilities ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void printDeviceInfo(const DeviceInfo& info)
+{
+    printf("%s (%s, %s)\n", info.name.c_str(), info.typeName().c_str(), info.platformName.c_str());
+    printf("  version:          %s, driver %s\n", info.version.c_str(), info.driverVersion.c_str());
+    printf("  compute units:    %u at %u MHz\n", info.computeUnits, info.clockMHz);
+    printf("  global memory:    %.1f MB, max buffer %.1f MB, cache %.1f KB\n",
+        info.globalMemSize / 1048576.0, info.maxAllocSize / 1048576.0, info.globalCacheSize / 1024.0);
+    printf("  local memory:     %.1f KB\n", info.localMemSize / 1024.0);
+    printf("  work-group:       %zu", info.maxWorkGroupSize);
+    for (size_t i = 0; i < info.maxWorkItemSizes.size(); i++) printf("%s%zu", i ? " x " : ", items ", info.maxWorkItemSizes[i]);
+    printf("\n");
+    printf("  vector widths:    char %u, short %u, int %u, long %u, float %u, double %u\n",
+        info.preferredWidthChar, info.preferredWidthShort, info.preferredWidthInt,
+        info.preferredWidthLong, info.preferredWidthFloat, info.preferredWidthDouble);
+    printf("  unified memory:   %s\n", info.unifiedMemory ? "yes" : "no");
+    printf("  extensions:       %s\n", info.extensions.c_str());
+}
+
+/**************************************************************************************************
+ * OpenCL device selection
+ *
+ * A specification string picks the device by type, by index, by name or by running a short
+ * benchmark on every usable device. The OPENCL_DEVICE environment variable gives the default
+ * specification, so the same binaries run on GPU nodes and on CPU-only runtimes such as POCL.
+ *
+ **************************************************************************************************/
+
+static const char* BENCHMARK_SOURCE = R"(
+__kernel void bench(__global float* data, const int iterations)
+{
+    size_t i = get_global_id(0);
+    float x = data[i], y = x + 1.0f, z = x + 2.0f, w = x + 3.0f;
+    for (int k = 0; k < iterations; k++) {
+        x = fma(x, 0.999f, 0.001f); y = fma(y, 0.999f, 0.001f);
+        z = fma(z, 0.999f, 0.001f); w = fma(w, 0.999f, 0.001f);
+    }
+    data[i] = x + y + z + w;
+}
+)";
+
+//~~~~~ Run the benchmark kernel on device, best time in ms ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// The kernel streams a 16 MB buffer and runs four FMA chains per element, so both memory bandwidth
+// and arithmetic throughput count. Returns infinity when the device fails to run it.
+
+double benchmarkDevice(const DeviceInfo& info)
+{
+    const size_t count = 4 << 20;
+    const int iterations = 64, runs = 3;
+
+    cl_int err;
+    cl_context context = nullptr;
+    cl_command_queue queue = nullptr;
+    cl_program program = nullptr;
+    cl_kernel kernel = nullptr;
+    cl_mem data = nullptr;
+    double best = std::numeric_limits<double>::infinity();
+
+    context = clCreateContext(NULL, 1, &info.device, NULL, NULL, &err);
+    if (err == CL_SUCCESS) queue = clCreateCommandQueueWithProperties(context, info.device, NULL, &err);
+    if (err == CL_SUCCESS) program = clCreateProgramWithSource(context, 1, &BENCHMARK_SOURCE, NULL, &err);
+    if (err == CL_SUCCESS) err = clBuildProgram(program, 1, &info.device, "", NULL, NULL);
+    if (err == CL_SUCCESS) kernel = clCreateKernel(program, "bench", &err);
+    if (err == CL_SUCCESS) data = clCreateBuffer(context, CL_MEM_READ_WRITE, count * sizeof(float), NULL, &err);
+    if (err == CL_SUCCESS)
+    {
+        float zero = 0;
+        err = clEnqueueFillBuffer(queue, data, &zero, sizeof(zero), 0, count * sizeof(float), 0, NULL, NULL);
+        if (err == CL_SUCCESS) err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &data);
+        if (err == CL_SUCCESS) err = clSetKernelArg(kernel, 1, sizeof(int), &iterations);
+        for (int run = 0; run <= runs && err == CL_SUCCESS; run++)     // run 0 warms up
+        {
+            Timer timer;
+            err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+            if (err == CL_SUCCESS) err = clFinish(queue);
+            if (err == CL_SUCCESS && run > 0) best = std::min(best, timer.ms());
+        }
+    }
+
+    if (data) clReleaseMemObject(data);
+    if (kernel) clReleaseKernel(kernel);
+    if (program) clReleaseProgram(program);
+    if (queue) clReleaseCommandQueue(queue);
+    if (context) clReleaseContext(context);
+    return err == CL_SUCCESS ? best : std::numeric_limits<double>::infinity();
+}
+
+//~~~~~ Select device by specification ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+DeviceInfo selectDevice(const std::string& spec)
+{
+    std::string policy = spec;
+    if (policy.empty())
+    {
+        const char* env = getenv("OPENCL_DEVICE");
+        policy = env && *env ? env : "default";
+    }
+    std::string lower = lowerCase(policy);
+
+    std::vector<DeviceInfo> all = listDevices(), usable;
+    for (const auto& info : all) if (info.available && info.compilerAvailable) usable.push_back(info);
+    if (usable.empty()) throw OpenClError("No usable OpenCL devices found");
+
+    auto best = [](const std::vector<DeviceInfo>& devices, cl_device_type type) -> const DeviceInfo* {
+        const DeviceInfo* result = nullptr;
+        for (const auto& info : devices)
+            if ((info.type & type) && (!result || info.score() > result->score())) result = &info;
+        return result;
+    };
+
+    // Device of a type, the default policy falls through GPU, accelerator and CPU
+
+    const DeviceInfo* found = nullptr;
+    if (lower == "gpu") found = best(usable, CL_DEVICE_TYPE_GPU);
+    else if (lower == "cpu") found = best(usable, CL_DEVICE_TYPE_CPU);
+    else if (lower == "accelerator") found = best(usable, CL_DEVICE_TYPE_ACCELERATOR);
+    else if (lower == "default")
+    {
+        found = best(usable, CL_DEVICE_TYPE_GPU);
+        if (!found) found = best(usable, CL_DEVICE_TYPE_ACCELERATOR);
+        if (!found) found = best(usable, CL_DEVICE_TYPE_ALL);
+    }
+    else if (lower == "fastest")
+    {
+        double bestTime = std::numeric_limits<double>::infinity();
+        for (const auto& info : usable)
+        {
+            double time = benchmarkDevice(info);
+            if (time < bestTime) { bestTime = time; found = &info; }
+        }
+    }
+    else if (policy.find(':') != std::string::npos && isdigit((unsigned char)policy[0]))
+    {
+        // Platform and device indexes count all platforms and devices, usable or not
+
+        int platformIndex = (int)strtoul(policy.c_str(), NULL, 10);
+        int deviceIndex = (int)strtoul(policy.c_str() + policy.find(':') + 1, NULL, 10);
+        for (const auto& info : all)
+            if (info.platformIndex == platformIndex && info.deviceIndex == deviceIndex) { found = &info; break; }
+    }
+    else
+    {
+        std::string text = lower.compare(0, 5, "name:") == 0 ? lower.substr(5) : lower;
+        for (const auto& info : usable)
+        {
+            if (lowerCase(info.name + " " + info.vendor + " " + info.platformName).find(text) != std::string::npos) { found = &info; break; }
+        }
+    }
+
+    if (!found) throw OpenClError("No OpenCL device matches \"" + policy + "\"");
+    return *found;
+}
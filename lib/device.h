@@ -0,0 +1,62 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <CL/cl.h>
+#include <string>
+#include <vector>
+
+// Capabilities of an OpenCL device, queried once with queryDevice
+
+struct DeviceInfo {
+    cl_platform_id platform = 0;
+    cl_device_id device = 0;
+    std::string platformName{};
+    std::string name{};
+    std::string vendor{};
+    std::string version{};
+    std::string driverVersion{};
+    cl_device_type type = 0;
+    bool available = false;
+    bool compilerAvailable = false;
+    cl_uint computeUnits = 0;
+    cl_uint clockMHz = 0;                   // maximum clock frequency
+    cl_ulong globalMemSize = 0;
+    cl_ulong globalCacheSize = 0;
+    cl_ulong localMemSize = 0;
+    cl_ulong maxAllocSize = 0;              // largest single buffer
+    cl_uint memBaseAddrAlign = 0;           // bits
+    size_t maxWorkGroupSize = 0;
+    std::vector<size_t> maxWorkItemSizes{};
+    cl_uint preferredWidthChar = 0;         // preferred vector widths, 0 if the type is unsupported
+    cl_uint preferredWidthShort = 0;
+    cl_uint preferredWidthInt = 0;
+    cl_uint preferredWidthLong = 0;
+    cl_uint preferredWidthFloat = 0;
+    cl_uint preferredWidthDouble = 0;
+    bool unifiedMemory = false;             // device shares memory with the host
+    std::string extensions{};
+    int platformIndex = -1;                 // position in clGetPlatformIDs and clGetDeviceIDs order,
+    int deviceIndex = -1;                   // set by listDevices, -1 for devices queried directly
+
+    bool hasExtension(const std::string& extension) const;
+    std::string typeName() const;
+    double score() const;                   // rough peak throughput estimate for ranking
+};
+
+DeviceInfo queryDevice(cl_device_id device);
+std::vector<DeviceInfo> listDevices();
+void printDeviceInfo(const DeviceInfo& info);
+
+// Device selection by a specification string:
+//   ""            - the OPENCL_DEVICE environment variable if set, otherwise "default"
+//   "default"     - the best GPU, then accelerator, then CPU device
+//   "gpu", "cpu", "accelerator" - the best device of the type
+//   "fastest"     - the device with the shortest run of a small benchmark kernel
+//   "P:D"         - device D of platform P, zero-based indexes of clGetPlatformIDs and clGetDeviceIDs order
+//   "name:TEXT" or any other text - the first device whose name, vendor or platform contains TEXT
+// Devices are ranked by DeviceInfo::score, unavailable devices and devices without a compiler are skipped
+
+DeviceInfo selectDevice(const std::string& spec = "");
+double benchmarkDevice(const DeviceInfo& info);
+
+#endif // DEVICE_H
@@ -0,0 +1,128 @@
+#include "future.h"
+
+/**************************************************************************************************
+ * Futures of asynchronous commands
+ *
+ * The state of a future is shared by its copies and by the completion callback, which holds its
+ * own reference until it ran, so a future may be dropped while its command is still in flight.
+ * The callback fires with CL_COMPLETE or with the negative error status of a failed command, and
+ * the future becomes ready after the continuations ran, so wait() also waits for them.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Constructors ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+JobFuture::JobFuture(cl_event event)
+    : _state(std::make_shared<State>())
+{
+    if (!event) throw OpenClError("Future needs an event");
+    _state->event = event;
+    auto holder = new std::shared_ptr<State>(_state);
+    cl_int err = clSetEventCallback(event, CL_COMPLETE, onComplete, holder);
+    if (err != CL_SUCCESS) delete holder;
+    checkError(err, "clSetEventCallback");
+}
+
+// Future completed by the host, device commands that depend on it wait until complete() is called
+
+JobFuture JobFuture::user(const Context& context)
+{
+    cl_int err;
+    cl_event event = clCreateUserEvent(context.context(), &err);
+    checkError(err, "clCreateUserEvent");
+    return JobFuture(event);
+}
+
+//~~~~~ Completion callback ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void CL_CALLBACK JobFuture::onComplete(cl_event, cl_int status, void* data)
+{
+    std::unique_ptr<std::shared_ptr<State>> holder((std::shared_ptr<State>*)data);
+    State& state = **holder;
+    for (;;)
+    {
+        std::vector<std::function<void(cl_int)>> continuations;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.status = status;
+            if (state.continuations.empty())
+            {
+                state.complete = true;
+                break;
+            }
+            continuations.swap(state.continuations);
+        }
+        for (auto& continuation : continuations) continuation(status);
+    }
+    state.done.notify_all();
+}
+
+//~~~~~ State queries ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool JobFuture::ready() const
+{
+    if (!_state) return true;
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    return _state->complete;
+}
+
+cl_int JobFuture::status() const
+{
+    if (!_state) return CL_COMPLETE;
+    std::lock_guard<std::mutex> lock(_state->mutex);
+    return _state->status;
+}
+
+//~~~~~ Wait for the command ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// clWaitForEvents flushes the queue of the command, the callback may still be running after it
+// returned, so the final status is taken from the callback
+
+void JobFuture::wait() const
+{
+    if (!_state) return;
+    clWaitForEvents(1, &_state->event);
+    std::unique_lock<std::mutex> lock(_state->mutex);
+    _state->done.wait(lock, [this] { return _state->complete; });
+    checkError(_state->status < 0 ? _state->status : CL_SUCCESS, "asynchronous command");
+}
+
+//~~~~~ Add continuation ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void JobFuture::then(std::function<void(cl_int)> continuation) const
+{
+    if (!_state) { continuation(CL_COMPLETE); return; }
+    cl_int status;
+    {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        if (!_state->complete)
+        {
+            _state->continuations.push_back(std::move(continuation));
+            return;
+        }
+        status = _state->status;
+    }
+    continuation(status);
+}
+
+//~~~~~ Complete user future ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void JobFuture::complete(cl_int status) const
+{
+    if (!_state) throw OpenClError("Empty future cannot be completed");
+    checkError(clSetUserEventStatus(_state->event, status), "clSetUserEventStatus");
+}
+
+//~~~~~ Events of futures for wait lists ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+std::vector<cl_event> waitList(const Dependencies& futures)
+{
+    std::vector<cl_event> events;
+    for (const auto& future : futures) if (future.valid()) events.push_back(future.event());
+    return events;
+}
+
+void waitAll(const Dependencies& futures)
+{
+    for (const auto& future : futures) future.wait();
+}
@@ -0,0 +1,61 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <CL/cl.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "context.h"
+
+// Completion handle of an asynchronous command, backed by its cl_event. A completion callback of
+// the driver marks it done, so ready() never blocks; wait() blocks until the command finished
+// and throws OpenClError when it failed. Copies share the same command, e.g.
+// JobFuture upload = job.writeAsync(a, data, n); prepareNext(); upload.wait();
+
+class JobFuture {
+private:
+    struct State {
+        cl_event event = nullptr;
+        std::mutex mutex{};
+        std::condition_variable done{};
+        bool complete = false;
+        cl_int status = CL_QUEUED;
+        std::vector<std::function<void(cl_int)>> continuations{};
+        ~State() { if (event) clReleaseEvent(event); }
+    };
+
+    std::shared_ptr<State> _state{};
+
+    static void CL_CALLBACK onComplete(cl_event event, cl_int status, void* data);
+
+public:
+    JobFuture() = default;                 // empty future, ready and never failing
+    explicit JobFuture(cl_event event);    // takes over the reference to the event
+    static JobFuture user(const Context& context);
+
+    bool valid() const { return _state != nullptr; }
+    cl_event event() const { return _state ? _state->event : nullptr; }
+    bool ready() const;
+    cl_int status() const;
+    void wait() const;
+
+    // Host function called with the final status once the command finished, immediately when it
+    // already has. It runs on a driver thread, so it must not call blocking OpenCL functions
+
+    void then(std::function<void(cl_int)> continuation) const;
+
+    // Completes a user future, device commands waiting for it may start
+
+    void complete(cl_int status = CL_COMPLETE) const;
+};
+
+// Futures a command must wait for, e.g. job.readAsync(buffer, result, n, { kernel })
+
+using Dependencies = std::vector<JobFuture>;
+
+std::vector<cl_event> waitList(const Dependencies& futures);
+void waitAll(const Dependencies& futures);
+
+#endif // FUTURE_H
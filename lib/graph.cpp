@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include "graph.h"
+
+/**************************************************************************************************
+ * Task graph scheduler
+ *
+ * Nodes are kept in the order they were added, which is a topological order because a node may
+ * only depend on earlier ones, so run() enqueues them in one pass. Every node gets an event, and
+ * the events of its dependencies form its wait list. On in-order queues a node goes to the queue
+ * of its first dependency, where that dependency is already ordered before it, and nodes without
+ * dependencies are spread over the queues in turn. The queues always profile, the node times
+ * come from the event timestamps.
+ *
+ **************************************************************************************************/
+
+static const size_t GRAPH_QUEUES = 4;   // in-order queues when the device has no out-of-order execution
+
+//~~~~~ Constructor and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+TaskGraph::TaskGraph(std::shared_ptr<Context> context, size_t inOrderQueues)
+    : _context(std::move(context))
+{
+    if (!_context) throw OpenClError("Task graph needs a context");
+
+    cl_command_queue_properties supported = 0;
+    clGetDeviceInfo(_context->device(), CL_DEVICE_QUEUE_ON_HOST_PROPERTIES, sizeof(supported), &supported, NULL);
+    _outOfOrder = inOrderQueues == 0 && (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+
+    cl_queue_properties properties = CL_QUEUE_PROFILING_ENABLE | (_outOfOrder ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0);
+    cl_queue_properties queueProps[] = { CL_QUEUE_PROPERTIES, properties, 0 };
+    size_t count = _outOfOrder ? 1 : inOrderQueues ? inOrderQueues : GRAPH_QUEUES;
+    try {
+        for (size_t i = 0; i < count; i++)
+        {
+            cl_int err;
+            cl_command_queue queue = clCreateCommandQueueWithProperties(_context->context(), _context->device(), queueProps, &err);
+            checkError(err, "clCreateCommandQueueWithProperties");
+            _queues.push_back(queue);
+        }
+    }
+    catch (...) {
+        for (auto queue : _queues) clReleaseCommandQueue(queue);
+        throw;
+    }
+}
+
+TaskGraph::~TaskGraph()
+{
+    for (auto queue : _queues) clFinish(queue);
+    releaseEvents();
+    for (auto queue : _queues) clReleaseCommandQueue(queue);
+}
+
+//~~~~~ Add nodes ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+TaskGraph::Node TaskGraph::add(NodeDesc&& node)
+{
+    Node id = (Node)_nodes.size();
+    for (Node dependency : node.after)
+        if (dependency < 0 || dependency >= id) throw OpenClError("Graph node " + std::to_string(id) + " depends on unknown node " + std::to_string(dependency));
+
+    if (node.kind == NodeKind::KERNEL)
+    {
+        for (const auto& arg : node.args)
+            if (arg.kind == KernelArg::BUFFER) throw OpenClError("Graph kernels take device buffers, not host arrays");
+        if (node.name.empty()) node.name = "kernel " + node.job->_kernels.at(node.kernel).name();
+    }
+
+    if (_outOfOrder) node.queue = 0;
+    else if (!node.after.empty()) node.queue = _nodes[node.after.front()].queue;
+    else node.queue = _nextQueue++ % _queues.size();
+
+    _nodes.push_back(std::move(node));
+    return id;
+}
+
+TaskGraph::Node TaskGraph::transfer(NodeKind kind, const DeviceBuffer& buffer, void* host, size_t bytes, const std::vector<Node>& after)
+{
+    if (!buffer || bytes > buffer.bytes()) throw OpenClError("Graph transfer outside of device buffer " + buffer.name());
+    NodeDesc node;
+    node.kind = kind;
+    node.name = (kind == NodeKind::WRITE ? "write " : "read ") + buffer.name();
+    node.after = after;
+    node.host = host;
+    node.bytes = bytes;
+    (kind == NodeKind::WRITE ? node.dst : node.src) = buffer.mem();
+    return add(std::move(node));
+}
+
+TaskGraph::Node TaskGraph::copy(const DeviceBuffer& from, const DeviceBuffer& to, const std::vector<Node>& after)
+{
+    if (!from || !to || from.bytes() > to.bytes()) throw OpenClError("Device buffer " + from.name() + " does not fit into " + to.name());
+    NodeDesc node;
+    node.kind = NodeKind::COPY;
+    node.name = "copy " + from.name() + " -> " + to.name();
+    node.after = after;
+    node.src = from.mem();
+    node.dst = to.mem();
+    node.bytes = from.bytes();
+    return add(std::move(node));
+}
+
+//~~~~~ Enqueue node after its dependencies ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void TaskGraph::enqueue(NodeDesc& node)
+{
+    std::vector<cl_event> waitList;
+    for (Node dependency : node.after) waitList.push_back(_nodes[dependency].event);
+    cl_uint waitCount = (cl_uint)waitList.size();
+    const cl_event* waitEvents = waitList.empty() ? NULL : waitList.data();
+    cl_command_queue queue = _queues[node.queue];
+
+    cl_int err = CL_SUCCESS;
+    switch (node.kind)
+    {
+        case NodeKind::KERNEL:
+            for (cl_uint index = 0; index < node.args.size(); index++) node.job->bindArg(node.kernel, index, node.args[index]);
+            node.event = node.job->enqueueKernelOn(queue, node.kernel, node.range, waitList);
+            break;
+        case NodeKind::WRITE:
+            err = clEnqueueWriteBuffer(queue, node.dst, CL_FALSE, 0, node.bytes, node.host, waitCount, waitEvents, &node.event);
+            checkError(err, "clEnqueueWriteBuffer");
+            break;
+        case NodeKind::READ:
+            err = clEnqueueReadBuffer(queue, node.src, CL_FALSE, 0, node.bytes, node.host, waitCount, waitEvents, &node.event);
+            checkError(err, "clEnqueueReadBuffer");
+            break;
+        default:
+            err = clEnqueueCopyBuffer(queue, node.src, node.dst, 0, 0, node.bytes, waitCount, waitEvents, &node.event);
+            checkError(err, "clEnqueueCopyBuffer");
+    }
+}
+
+//~~~~~ Run graph and collect node times ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void TaskGraph::run()
+{
+    releaseEvents();
+    _timing.clear();
+    _context->finish();
+
+    try {
+        for (auto& node : _nodes) enqueue(node);
+        for (auto queue : _queues) checkError(clFlush(queue), "clFlush");
+        for (auto queue : _queues) checkError(clFinish(queue), "clFinish");
+    }
+    catch (...) {
+        for (auto queue : _queues) clFinish(queue);
+        releaseEvents();
+        throw;
+    }
+
+    std::vector<std::pair<cl_ulong, cl_ulong>> times;
+    cl_ulong first = ~(cl_ulong)0;
+    for (const auto& node : _nodes)
+    {
+        cl_ulong start = 0, end = 0;
+        checkError(clGetEventProfilingInfo(node.event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL), "clGetEventProfilingInfo");
+        checkError(clGetEventProfilingInfo(node.event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL), "clGetEventProfilingInfo");
+        times.emplace_back(start, end);
+        first = std::min(first, start);
+    }
+    for (size_t i = 0; i < _nodes.size(); i++)
+        _timing.push_back({ _nodes[i].name, (times[i].first - first) * 1e-6, (times[i].second - first) * 1e-6 });
+    releaseEvents();
+}
+
+//~~~~~ Remove nodes ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void TaskGraph::clear()
+{
+    releaseEvents();
+    _nodes.clear();
+    _timing.clear();
+    _nextQueue = 0;
+}
+
+void TaskGraph::releaseEvents()
+{
+    for (auto& node : _nodes)
+    {
+        if (node.event) clReleaseEvent(node.event);
+        node.event = nullptr;
+    }
+}
+
+//~~~~~ Timing summary ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+double TaskGraph::makespan() const
+{
+    double end = 0;
+    for (const auto& timing : _timing) end = std::max(end, timing.end);
+    return end;
+}
+
+double TaskGraph::busy() const
+{
+    double total = 0;
+    for (const auto& timing : _timing) total += timing.end - timing.start;
+    return total;
+}
+
+// Nodes of the same name are summed, the overlap is the busy time over the makespan, 1.0 when
+// the nodes ran strictly one after another
+
+void TaskGraph::printTiming() const
+{
+    struct Summary { size_t count = 0; double total = 0, first = 1e300, last = 0; };
+    std::vector<std::string> order;
+    std::map<std::string, Summary> summaries;
+    for (const auto& timing : _timing)
+    {
+        Summary& summary = summaries[timing.name];
+        if (summary.count++ == 0) order.push_back(timing.name);
+        summary.total += timing.end - timing.start;
+        summary.first = std::min(summary.first, timing.start);
+        summary.last = std::max(summary.last, timing.end);
+    }
+
+    double span = makespan();
+    printf("Task graph: %zu nodes on %s\n", _nodes.size(), _outOfOrder ? "an out-of-order queue" : (std::to_string(_queues.size()) + " in-order queues").c_str());
+    printf("  %-32s %6s %12s %12s %12s\n", "node", "count", "total, ms", "first, ms", "last, ms");
+    for (const auto& name : order)
+    {
+        const Summary& summary = summaries.at(name);
+        printf("  %-32s %6zu %12.3f %12.3f %12.3f\n", name.c_str(), summary.count, summary.total, summary.first, summary.last);
+    }
+    printf("  makespan %.3f ms, busy %.3f ms, overlap %.2fx\n", span, busy(), span > 0 ? busy() / span : 1.0);
+}
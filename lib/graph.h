@@ -0,0 +1,108 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "opencl.h"
+
+// Device time of one graph node in ms from the start of the first node
+
+struct GraphNodeTiming {
+    std::string name{};
+    double start = 0;
+    double end = 0;
+};
+
+// Graph of kernel launches and transfers with explicit dependencies, e.g.
+// TaskGraph graph(context); auto up = graph.write(a, data, n); graph.kernel(job, K, {n}, { up }, a, b);
+// run() submits the nodes with event wait lists to an out-of-order queue, or to several in-order
+// queues when the device has no out-of-order execution, so that independent nodes run
+// concurrently. A node may only depend on nodes added before it, so the graph has no cycles.
+// Kernel arguments are device buffers, scalars and local memory; host arrays of write and read
+// nodes and the jobs of kernel nodes must stay valid until run() returned
+
+class TaskGraph {
+public:
+    using Node = int;
+
+private:
+    enum class NodeKind { KERNEL, WRITE, READ, COPY };
+
+    struct NodeDesc {
+        NodeKind kind = NodeKind::KERNEL;
+        std::string name{};
+        std::vector<Node> after{};
+        OpenCL* job = nullptr;
+        int kernel = 0;
+        NDRange range{ 0 };
+        std::vector<KernelArg> args{};
+        cl_mem src = nullptr;
+        cl_mem dst = nullptr;
+        void* host = nullptr;
+        size_t bytes = 0;
+        size_t queue = 0;
+        cl_event event = nullptr;
+    };
+
+    std::shared_ptr<Context> _context;
+    std::vector<cl_command_queue> _queues{};
+    bool _outOfOrder = false;
+    size_t _nextQueue = 0;
+    std::vector<NodeDesc> _nodes{};
+    std::vector<GraphNodeTiming> _timing{};
+
+    Node add(NodeDesc&& node);
+    Node transfer(NodeKind kind, const DeviceBuffer& buffer, void* host, size_t bytes, const std::vector<Node>& after);
+    void enqueue(NodeDesc& node);
+    void releaseEvents();
+
+public:
+    // inOrderQueues > 0 uses that many in-order queues even when out-of-order queues are available
+
+    explicit TaskGraph(std::shared_ptr<Context> context, size_t inOrderQueues = 0);
+    ~TaskGraph();
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    template<class... Args, class = OpenCL::KernelArgs<Args...>> Node kernel(OpenCL& job, int idKernel, const NDRange& range, const std::vector<Node>& after, const Args&... args)
+    {
+        NodeDesc node;
+        node.kind = NodeKind::KERNEL;
+        node.job = &job;
+        node.kernel = idKernel;
+        node.range = range;
+        node.after = after;
+        node.args = { OpenCL::toArg(args)... };
+        return add(std::move(node));
+    }
+
+    template<class T> Node write(const DeviceBuffer& buffer, const T* data, size_t count, const std::vector<Node>& after = {})
+    {
+        return transfer(NodeKind::WRITE, buffer, const_cast<T*>(data), sizeof(T) * count, after);
+    }
+
+    template<class T> Node read(const DeviceBuffer& buffer, T* data, size_t count, const std::vector<Node>& after = {})
+    {
+        return transfer(NodeKind::READ, buffer, data, sizeof(T) * count, after);
+    }
+
+    Node copy(const DeviceBuffer& from, const DeviceBuffer& to, const std::vector<Node>& after = {});
+    void rename(Node node, const std::string& name) { _nodes.at(node).name = name; }
+
+    // Waits for the commands of the context queue, submits all nodes and waits for them, a graph
+    // may be run again with the same nodes
+
+    void run();
+    void clear();
+
+    size_t size() const { return _nodes.size(); }
+    bool outOfOrder() const { return _outOfOrder; }
+    size_t queues() const { return _queues.size(); }
+    const std::vector<GraphNodeTiming>& timing() const { return _timing; }
+    double makespan() const;     // ms from the first node start to the last node end
+    double busy() const;         // sum of node times in ms, above makespan when nodes overlapped
+    void printTiming() const;
+};
+
+#endif // GRAPH_H
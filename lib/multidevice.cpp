@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
+#include "multidevice.h"
+
+/**************************************************************************************************
+ * Multi-device executor
+ *
+ * All devices share one OpenCL context, so a split argument is one buffer with a sub-buffer per
+ * device part, and every device has its own profiling queue. Part sizes are multiples of the
+ * item count whose bytes meet the sub-buffer alignment (CL_DEVICE_MEM_BASE_ADDR_ALIGN) of every
+ * split argument. The time of a part is taken from the event timestamps of its device, from the
+ * start of its first command to the end of its last one, so the clocks of different devices are
+ * never compared.
+ *
+ **************************************************************************************************/
+
+static const double MIN_SHARE = 0.01;   // a device keeps some items so that its throughput is measured again
+
+//~~~~~ Constructors and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+MultiDevice::MultiDevice(const std::string& spec)
+{
+    std::string policy = spec;
+    if (policy.empty())
+    {
+        const char* env = getenv("OPENCL_DEVICES");
+        policy = env && *env ? env : "all";
+    }
+
+    std::vector<DeviceInfo> devices;
+    if (policy == "all")
+    {
+        // Usable devices grouped by platform, the platform with the most devices wins
+        std::vector<DeviceInfo> usable;
+        for (const auto& info : listDevices()) if (info.available && info.compilerAvailable) usable.push_back(info);
+        for (const auto& info : usable)
+        {
+            std::vector<DeviceInfo> same;
+            for (const auto& other : usable) if (other.platform == info.platform) same.push_back(other);
+            if (same.size() > devices.size()) devices = same;
+        }
+        if (devices.empty()) throw OpenClError("No usable OpenCL devices found");
+    }
+    else if (policy.compare(0, 6, "split:") == 0)
+    {
+        cl_uint parts = (cl_uint)strtoul(policy.c_str() + 6, NULL, 10);
+        _subDevices = partitionDevice(selectDevice(), parts);
+        for (cl_device_id device : _subDevices) devices.push_back(queryDevice(device));
+    }
+    else
+    {
+        size_t start = 0;
+        while (start <= policy.size())
+        {
+            size_t end = policy.find(',', start);
+            if (end == std::string::npos) end = policy.size();
+            devices.push_back(selectDevice(policy.substr(start, end - start)));
+            start = end + 1;
+        }
+    }
+
+    try { init(devices); }
+    catch (...) { release(); throw; }
+}
+
+MultiDevice::MultiDevice(const std::vector<DeviceInfo>& devices)
+{
+    try { init(devices); }
+    catch (...) { release(); throw; }
+}
+
+MultiDevice::~MultiDevice()
+{
+    release();
+}
+
+//~~~~~ Create shared context and device queues ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void MultiDevice::init(const std::vector<DeviceInfo>& devices)
+{
+    if (devices.empty()) throw OpenClError("Multi-device executor needs devices");
+    std::vector<cl_device_id> ids;
+    for (const auto& info : devices)
+    {
+        if (info.platform != devices.front().platform) throw OpenClError("Devices " + devices.front().name + " and " + info.name + " are on different platforms");
+        if (std::find(ids.begin(), ids.end(), info.device) != ids.end()) throw OpenClError("Device " + info.name + " is selected twice");
+        ids.push_back(info.device);
+    }
+
+    cl_int err;
+    cl_context_properties properties[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)devices.front().platform, 0 };
+    _context = clCreateContext(properties, (cl_uint)ids.size(), ids.data(), NULL, NULL, &err);
+    checkError(err, "clCreateContext");
+
+    // The first shares follow the device scores
+    double total = 0;
+    for (const auto& info : devices) total += info.score();
+    for (const auto& info : devices)
+    {
+        Worker worker;
+        worker.info = info;
+        worker.share.name = info.name;
+        worker.share.share = total > 0 ? info.score() / total : 1.0 / devices.size();
+        cl_queue_properties queueProps[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+        worker.queue = clCreateCommandQueueWithProperties(_context, info.device, queueProps, &err);
+        checkError(err, "clCreateCommandQueueWithProperties");
+        _workers.push_back(worker);
+    }
+}
+
+//~~~~~ Release OpenCL resources ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void MultiDevice::release()
+{
+    releaseKernels();
+    if (_program) clReleaseProgram(_program);
+    _program = nullptr;
+    for (auto& worker : _workers) if (worker.queue) clReleaseCommandQueue(worker.queue);
+    _workers.clear();
+    if (_context) clReleaseContext(_context);
+    _context = nullptr;
+    for (cl_device_id device : _subDevices) clReleaseDevice(device);
+    _subDevices.clear();
+}
+
+void MultiDevice::releaseKernels()
+{
+    for (auto& worker : _workers)
+    {
+        for (cl_kernel kernel : worker.kernels) clReleaseKernel(kernel);
+        worker.kernels.clear();
+    }
+    _kernelNames.clear();
+}
+
+//~~~~~ Partition device into equal sub-devices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// E.g. a CPU device of 8 compute units into 2 sub-devices of 4, the caller releases them with clReleaseDevice
+
+std::vector<cl_device_id> MultiDevice::partitionDevice(const DeviceInfo& device, cl_uint parts)
+{
+    if (parts < 1 || device.computeUnits < parts)
+        throw OpenClError("Device " + device.name + " with " + std::to_string(device.computeUnits) + " compute units cannot be split into " + std::to_string(parts) + " parts");
+
+    cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(device.computeUnits / parts), 0 };
+    cl_uint count = 0;
+    checkError(clCreateSubDevices(device.device, properties, 0, NULL, &count), "clCreateSubDevices");
+    std::vector<cl_device_id> devices(count);
+    checkError(clCreateSubDevices(device.device, properties, count, devices.data(), NULL), "clCreateSubDevices");
+
+    // Equal partitions may leave more sub-devices than asked for, the extra ones are not used
+    for (cl_uint i = parts; i < count; i++) clReleaseDevice(devices[i]);
+    devices.resize(std::min(count, parts));
+    return devices;
+}
+
+//~~~~~ Build program for all devices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void MultiDevice::build(const std::string& kernelSourceFile, const BuildOptions& buildOptions)
+{
+    releaseKernels();
+    if (_program) clReleaseProgram(_program);
+    _program = nullptr;
+
+    std::vector<cl_device_id> ids;
+    for (const auto& worker : _workers) ids.push_back(worker.info.device);
+    _program = buildProgram(_context, ids, Program::loadSource(kernelSourceFile), buildOptions.str());
+}
+
+//~~~~~ Create kernel on all devices, returns its id ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+int MultiDevice::kernel(const std::string& name)
+{
+    if (!_program) throw OpenClError("Multi-device program is not built");
+    auto it = std::find(_kernelNames.begin(), _kernelNames.end(), name);
+    if (it != _kernelNames.end()) return (int)(it - _kernelNames.begin());
+
+    for (auto& worker : _workers)
+    {
+        cl_int err;
+        cl_kernel kernel = clCreateKernel(_program, name.c_str(), &err);
+        checkError(err, "clCreateKernel " + name);
+        worker.kernels.push_back(kernel);
+    }
+    _kernelNames.push_back(name);
+    return (int)_kernelNames.size() - 1;
+}
+
+//~~~~~ Cut items into device parts by the shares ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void MultiDevice::partition(size_t items, size_t quantum)
+{
+    // Every part but the last one is a multiple of quantum, so all parts start on a multiple of it
+    size_t assigned = 0;
+    for (auto& worker : _workers)
+    {
+        DeviceShare& share = worker.share;
+        share.items = std::min((size_t)(share.share * items), items - assigned) / quantum * quantum;
+        assigned += share.items;
+    }
+    _workers.back().share.items += items - assigned;       // rounding remainder
+
+    size_t offset = 0;
+    for (auto& worker : _workers)
+    {
+        if (offset % quantum != 0) throw OpenClError("Part of " + worker.share.name + " starts at item " + std::to_string(offset) + ", not a multiple of " + std::to_string(quantum));
+        worker.share.offset = offset;
+        offset += worker.share.items;
+    }
+}
+
+//~~~~~ Move shares towards the measured throughput ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void MultiDevice::rebalance()
+{
+    double measured = 0, measuredShare = 0;
+    for (const auto& worker : _workers)
+    {
+        if (worker.share.throughput <= 0) continue;
+        measured += worker.share.throughput;
+        measuredShare += worker.share.share;
+    }
+    if (measured <= 0) return;
+
+    // Devices without a measurement keep their share, the others divide the rest by throughput
+    double total = 0;
+    for (auto& worker : _workers)
+    {
+        DeviceShare& share = worker.share;
+        if (share.throughput > 0)
+        {
+            double target = measuredShare * share.throughput / measured;
+            share.share += _adaptRate * (target - share.share);
+        }
+        share.share = std::max(share.share, MIN_SHARE);
+        total += share.share;
+    }
+    for (auto& worker : _workers) worker.share.share /= total;
+}
+
+//~~~~~ Run kernel over items split between devices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void MultiDevice::runParts(int idKernel, size_t items, const std::function<NDRange(size_t)>& range, const std::vector<PartArg>& args)
+{
+    if (idKernel < 0 || idKernel >= (int)_kernelNames.size()) throw OpenClError("Unknown kernel " + std::to_string(idKernel));
+    if (items == 0) return;
+
+    // Part sizes whose bytes keep every sub-buffer origin aligned on every device
+    size_t align = 1, quantum = 1;
+    for (const auto& worker : _workers) align = std::max<size_t>(align, worker.info.memBaseAddrAlign / 8);
+    for (const auto& part : args)
+    {
+        if (part.arg.kind == KernelArg::DEVICE) throw OpenClError("Device buffers of a context cannot be used by the multi-device executor");
+        if (part.mode == PartArg::WHOLE && part.arg.kind == KernelArg::BUFFER && part.arg.output) throw OpenClError("Output arguments must be split between devices");
+        if (part.mode != PartArg::SPLIT) continue;
+        if (part.arg.bytes % items != 0) throw OpenClError("Split argument of " + std::to_string(part.arg.bytes) + " bytes does not divide into " + std::to_string(items) + " items");
+        size_t itemBytes = part.arg.bytes / items;
+        quantum = std::lcm(quantum, align / std::gcd(align, itemBytes));
+    }
+    partition(items, quantum);
+
+    std::vector<cl_mem> buffers;                           // parent buffers and sub-buffers, released at the end
+    std::vector<std::vector<cl_event>> events(_workers.size());
+    auto releaseAll = [&]() {
+        for (auto& list : events) for (cl_event event : list) clReleaseEvent(event);
+        for (auto it = buffers.rbegin(); it != buffers.rend(); ++it) clReleaseMemObject(*it);
+    };
+
+    try {
+        // One buffer per buffer argument, split ones get a sub-buffer per device part
+        cl_int err;
+        std::vector<cl_mem> whole(args.size(), nullptr);
+        std::vector<std::vector<cl_mem>> parts(_workers.size(), std::vector<cl_mem>(args.size(), nullptr));
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            const KernelArg& arg = args[i].arg;
+            if (arg.kind != KernelArg::BUFFER) continue;
+            cl_mem_flags flags = arg.input && arg.output ? CL_MEM_READ_WRITE : arg.input ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY;
+            bool copy = args[i].mode == PartArg::WHOLE && arg.input;
+            whole[i] = clCreateBuffer(_context, flags | (copy ? CL_MEM_COPY_HOST_PTR : 0), arg.bytes, copy ? arg.data : NULL, &err);
+            checkError(err, "clCreateBuffer");
+            buffers.push_back(whole[i]);
+            if (args[i].mode != PartArg::SPLIT) continue;
+
+            size_t itemBytes = arg.bytes / items;
+            for (size_t w = 0; w < _workers.size(); w++)
+            {
+                const DeviceShare& share = _workers[w].share;
+                if (!share.items) continue;
+                cl_buffer_region region = { share.offset * itemBytes, share.items * itemBytes };
+                parts[w][i] = clCreateSubBuffer(whole[i], flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+                checkError(err, "clCreateSubBuffer");
+                buffers.push_back(parts[w][i]);
+            }
+        }
+
+        // Upload, run and download each part on its device queue
+        for (size_t w = 0; w < _workers.size(); w++)
+        {
+            Worker& worker = _workers[w];
+            if (!worker.share.items) continue;
+            cl_kernel kernel = worker.kernels[idKernel];
+            for (cl_uint i = 0; i < args.size(); i++)
+            {
+                const KernelArg& arg = args[i].arg;
+                cl_int count = (cl_int)worker.share.items;
+                cl_mem mem = args[i].mode == PartArg::SPLIT ? parts[w][i] : whole[i];
+                if (args[i].mode == PartArg::PART_SIZE) err = clSetKernelArg(kernel, i, sizeof(count), &count);
+                else if (arg.kind == KernelArg::BUFFER) err = clSetKernelArg(kernel, i, sizeof(cl_mem), &mem);
+                else if (arg.kind == KernelArg::LOCAL) err = clSetKernelArg(kernel, i, arg.bytes, NULL);
+                else err = clSetKernelArg(kernel, i, arg.bytes, arg.value);
+                checkError(err, "clSetKernelArg");
+            }
+
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                const KernelArg& arg = args[i].arg;
+                if (args[i].mode != PartArg::SPLIT || !arg.input) continue;
+                size_t itemBytes = arg.bytes / items;
+                cl_event event = nullptr;
+                err = clEnqueueWriteBuffer(worker.queue, parts[w][i], CL_FALSE, 0, worker.share.items * itemBytes,
+                    (const char*)arg.data + worker.share.offset * itemBytes, 0, NULL, &event);
+                checkError(err, "clEnqueueWriteBuffer");
+                events[w].push_back(event);
+            }
+
+            NDRange partRange = range(worker.share.items);
+            cl_event event = nullptr;
+            err = clEnqueueNDRangeKernel(worker.queue, kernel, partRange.dims, NULL, partRange.global, partRange.hasLocal ? partRange.local : NULL, 0, NULL, &event);
+            checkError(err, "clEnqueueNDRangeKernel");
+            events[w].push_back(event);
+
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                const KernelArg& arg = args[i].arg;
+                if (args[i].mode != PartArg::SPLIT || !arg.output) continue;
+                size_t itemBytes = arg.bytes / items;
+                err = clEnqueueReadBuffer(worker.queue, parts[w][i], CL_FALSE, 0, worker.share.items * itemBytes,
+                    (char*)arg.data + worker.share.offset * itemBytes, 0, NULL, &event);
+                checkError(err, "clEnqueueReadBuffer");
+                events[w].push_back(event);
+            }
+            checkError(clFlush(worker.queue), "clFlush");
+        }
+        for (auto& worker : _workers) checkError(clFinish(worker.queue), "clFinish");
+
+        // Device time and throughput of each part
+        for (size_t w = 0; w < _workers.size(); w++)
+        {
+            DeviceShare& share = _workers[w].share;
+            share.ms = 0;
+            if (events[w].empty()) continue;
+            cl_ulong first = ~(cl_ulong)0, last = 0;
+            for (cl_event event : events[w])
+            {
+                cl_ulong start = 0, end = 0;
+                checkError(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL), "clGetEventProfilingInfo");
+                checkError(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL), "clGetEventProfilingInfo");
+                first = std::min(first, start);
+                last = std::max(last, end);
+            }
+            share.ms = (last - first) * 1e-6;
+            if (share.ms > 0) share.throughput = share.items / share.ms;
+        }
+    }
+    catch (...) {
+        for (auto& worker : _workers) clFinish(worker.queue);
+        releaseAll();
+        throw;
+    }
+    releaseAll();
+    rebalance();
+}
+
+//~~~~~ Shares of the devices ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// The items and times are those of the last run, the shares those of the next one
+
+std::vector<DeviceShare> MultiDevice::shares() const
+{
+    std::vector<DeviceShare> result;
+    for (const auto& worker : _workers) result.push_back(worker.share);
+    return result;
+}
+
+void MultiDevice::printShares() const
+{
+    for (const auto& worker : _workers)
+    {
+        const DeviceShare& share = worker.share;
+        printf("  %-40s items %10zu  %9.3f ms  %12.1f items/ms  next share %5.1f%%\n",
+            share.name.c_str(), share.items, share.ms, share.throughput, share.share * 100);
+    }
+}
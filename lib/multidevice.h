@@ -0,0 +1,111 @@
+#ifndef MULTIDEVICE_H
+#define MULTIDEVICE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "opencl.h"
+
+// Argument of a multi-device run: a kernel argument used whole by every device, a buffer argument
+// split into the parts of the devices, or the item count of the device part as an int scalar
+
+struct PartArg {
+    enum Mode : unsigned char { WHOLE, SPLIT, PART_SIZE };
+    Mode mode = WHOLE;
+    KernelArg arg{};
+    PartArg(const KernelArg& kernelArg) : arg(kernelArg) {}
+};
+
+inline PartArg split(const KernelArg& arg)
+{
+    if (arg.kind != KernelArg::BUFFER) throw OpenClError("Only host array arguments can be split between devices");
+    PartArg part(arg);
+    part.mode = PartArg::SPLIT;
+    return part;
+}
+
+inline PartArg partSize()
+{
+    PartArg part(scalar(0));
+    part.mode = PartArg::PART_SIZE;
+    return part;
+}
+
+// Share of one device in the last run
+
+struct DeviceShare {
+    std::string name{};
+    double share = 0;           // fraction of the items given to the device
+    size_t offset = 0;          // first item of the part
+    size_t items = 0;           // items of the part
+    double ms = 0;              // device time of the part from the first upload to the last download
+    double throughput = 0;      // items per ms measured in the part, 0 before the first run
+};
+
+// Kernel runs split across several devices of one platform, e.g.
+// MultiDevice devices("split:2"); devices.build("sum.cl"); int k = devices.kernel("sum");
+// devices.run(k, n, [](size_t items) { return NDRange(items); }, split(in(a, n)), split(in(b, n)), split(out(r, n)), partSize());
+// The items (elements of sum, rows of mul) are cut into one contiguous part per device. Split
+// arguments hold the same number of elements per item; every device gets sub-buffers of its part,
+// uploads and downloads them on its own queue and runs the kernel over its part, so kernels index
+// parts from 0. Whole buffer arguments are copied to every device. The first shares follow the
+// device scores, later runs move them towards the throughput measured in the previous run
+//
+// Device specifications ("" uses OPENCL_DEVICES, "all" by default):
+//   "all"        - all usable devices of the platform with the most of them
+//   "split:N"    - the device selected by OPENCL_DEVICE partitioned into N equal sub-devices
+//   "S1,S2,..."  - devices chosen by selectDevice specs, all of one platform, e.g. "0:0,0:1"
+
+class MultiDevice {
+private:
+    struct Worker {
+        DeviceInfo info{};
+        cl_command_queue queue = nullptr;
+        std::vector<cl_kernel> kernels{};
+        DeviceShare share{};
+    };
+
+    std::vector<Worker> _workers{};
+    std::vector<cl_device_id> _subDevices{};    // created by partitioning, released with the executor
+    cl_context _context = nullptr;
+    cl_program _program = nullptr;
+    std::vector<std::string> _kernelNames{};
+    double _adaptRate = 0.5;
+
+    void init(const std::vector<DeviceInfo>& devices);
+    void release();
+    void releaseKernels();
+    void partition(size_t items, size_t quantum);
+    void rebalance();
+    void runParts(int idKernel, size_t items, const std::function<NDRange(size_t)>& range, const std::vector<PartArg>& args);
+
+public:
+    explicit MultiDevice(const std::string& spec = "");
+    explicit MultiDevice(const std::vector<DeviceInfo>& devices);
+    ~MultiDevice();
+    MultiDevice(const MultiDevice&) = delete;
+    MultiDevice& operator=(const MultiDevice&) = delete;
+
+    static std::vector<cl_device_id> partitionDevice(const DeviceInfo& device, cl_uint parts);
+
+    // Builds the program for all devices through the binary cache of Program, kernels of an earlier
+    // build are released
+
+    void build(const std::string& kernelSourceFile, const BuildOptions& buildOptions = {});
+    int kernel(const std::string& name);
+
+    // range gives the NDRange of a part of the given number of items. Shares move by adaptRate
+    // (0..1) of the difference to the measured ones after each run
+
+    template<class... Args> void run(int idKernel, size_t items, const std::function<NDRange(size_t)>& range, const Args&... args)
+    {
+        runParts(idKernel, items, range, { PartArg(args)... });
+    }
+
+    void setAdaptRate(double rate) { _adaptRate = rate < 0 ? 0 : rate > 1 ? 1 : rate; }
+    size_t devices() const { return _workers.size(); }
+    std::vector<DeviceShare> shares() const;
+    void printShares() const;
+};
+
+#endif // MULTIDEVICE_H
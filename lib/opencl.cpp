@@ -1,31 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
 #include "opencl.h"
-#include <sys/time.h>
+#include "tuner.h"
+#include <sys/stat.h>
 
-//~~~~~ Get current time in milliseconds ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
-size_t getTime()
-{
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (size_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
-}
+//~~~~~ Constructors and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-//~~~~~ OpenCL error class ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OpenCL::OpenCL(const std::string & kernelSourceFile, const std::string & kernelName, bool profiling, const BuildOptions& buildOptions) 
+    : OpenCL(Context::create(profiling), kernelSourceFile, std::vector<std::string>{ kernelName }, buildOptions) {}
 
-OpenClError::OpenClError(cl_int err, const std::string& operation)
-    : std::runtime_error("OpenCL error during " + operation + ": " + std::to_string(err)) {}
+OpenCL::OpenCL(const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames, bool profiling, const BuildOptions& buildOptions)
+    : OpenCL(Context::create(profiling), kernelSourceFile, kernelNames, buildOptions) {}
 
-OpenClError::OpenClError(const std::string& message)
-    : std::runtime_error(message) {}
+OpenCL::OpenCL(std::shared_ptr<Context> context, const std::string& kernelSourceFile, const std::string& kernelName, const BuildOptions& buildOptions)
+    : OpenCL(std::make_shared<Program>(std::move(context), kernelSourceFile, buildOptions), std::vector<std::string>{ kernelName }) {}
 
-//~~~~~ Constructors and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+OpenCL::OpenCL(std::shared_ptr<Context> context, const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames, const BuildOptions& buildOptions)
+    : OpenCL(std::make_shared<Program>(std::move(context), kernelSourceFile, buildOptions), kernelNames) {}
 
-OpenCL::OpenCL(const std::string & kernelSourceFile, const std::string & kernelName) 
+OpenCL::OpenCL(std::shared_ptr<Program> program, const std::vector<std::string>& kernelNames)
+    : _context(program->context()), _program(std::move(program))
 {
     try {
-        init(kernelSourceFile, { kernelName });
+        init(kernelNames);
     }
     catch (...) {
         release();
@@ -33,167 +34,197 @@ OpenCL::OpenCL(const std::string & kernelSourceFile, const std::string & kernelN
     }
 }
 
-OpenCL::OpenCL(const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames)
-{
-    try {
-        init(kernelSourceFile, kernelNames);
-    }
-    catch (...) {
-        release();
-        throw;
+OpenCL::~OpenCL() {
+    if (_profiling) {
+        try { printProfile(); } catch (...) {}
     }
+    release();
 }
 
+//~~~~~ Create kernels of the program ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-OpenCL::~OpenCL() {
-    release();
+void OpenCL::init(const std::vector<std::string>& kernelNames) 
+{
+    _profiling = _context->profiling();
+    setHostMemory(HostMemory::AUTO);
+    for (const auto& kernelName : kernelNames) _kernels.emplace_back(_program, kernelName);
 }
 
-//~~~~~ Load kernel source from file ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~ Release OpenCL resources ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-char* OpenCL::loadKernelSource(const std::string& filename)
+void OpenCL::release() 
 {
-    FILE *file = nullptr;
-    char *kernelSource = nullptr;
-    try {
-        file = fopen(filename.c_str(), "r");
-        if (!file) throw OpenClError("Failed to load kernel file");
-        fseek(file, 0, SEEK_END);
-        size_t file_size = ftell(file);
-        rewind(file);
-    
-        kernelSource = (char*)malloc(file_size + 1);
-        if (!kernelSource) throw OpenClError("Failed to allocate memory for kernel source");
-        fread(kernelSource, 1, file_size, file);
-        kernelSource[file_size] = '\0';
-        fclose(file);
-    }
-    catch (...) {
-        if (file) fclose(file);
-        if (kernelSource) free(kernelSource);
-        throw;
+    for (const auto& pending : _pendingEvents) clReleaseEvent(std::get<1>(pending));
+    _pendingEvents.clear();
+    _kernels.clear();
+    freeBuffers();
+    if (!_inflight.empty()) clFinish(_context->queue());
+    recycleInflight(true);
+}
+
+/**************************************************************************************************
+ * OpenCL buffer management
+ *
+ * This section contains functions to create, read, and free OpenCL buffers.
+ * The buffers are created based on the argument types specified in the run method.
+ * Freed buffers are returned to the buffer pool of the context, and are reused
+ * by later createBuffers calls instead of allocating new device memory.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Convert untyped argument to typed argument ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+KernelArg OpenCL::toKernelArg(const std::tuple<ArgTypes, void*, size_t>& arg)
+{
+    void* value = std::get<1>(arg);
+    size_t count = std::get<2>(arg);
+    switch (std::get<0>(arg))
+    {
+        case ArgTypes::INT:         return scalar(*(int*)value);
+        case ArgTypes::IN_IBUF:     return in((int*)value, count);
+        case ArgTypes::OUT_IBUF:    return out((int*)value, count);
+        case ArgTypes::IN_OUT_IBUF: return inOut((int*)value, count);
+        case ArgTypes::IN_FBUF:     return in((float*)value, count);
+        case ArgTypes::OUT_FBUF:    return out((float*)value, count);
+        case ArgTypes::IN_OUT_FBUF: return inOut((float*)value, count);
+        default:
+            throw OpenClError("Invalid argument type");
     }
-    return kernelSource;
 }
 
-//~~~~~ Check OpenCL error and throw exception ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~ Get access flags for buffer argument ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-void OpenCL::checkError(cl_int err, const std::string& operation)
+cl_mem_flags OpenCL::argMemFlags(const KernelArg& arg)
 {
-    if (err != CL_SUCCESS) throw OpenClError(err, operation);
+    if (!arg.output) return CL_MEM_READ_ONLY;
+    if (!arg.input) return CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY;
+    return CL_MEM_READ_WRITE;
 }
 
-//~~~~~ Initialize OpenCL context, command queue, program, and kernel ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~ Select host memory mode for buffers created later ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-void OpenCL::init(const std::string & kernelSourceFile, const std::vector<std::string>& kernelNames) 
+void OpenCL::setHostMemory(HostMemory mode)
 {
-    // Get platform
-    cl_int err = clGetPlatformIDs(1, &_platform, NULL);
-    checkError(err, "clGetPlatformIDs");
+    if (mode == HostMemory::AUTO) mode = _context->unifiedMemory() ? HostMemory::USE_HOST_PTR : HostMemory::COPY;
+    _hostMemory = mode;
+}
 
-    // Get device
-    err = clGetDeviceIDs(_platform, CL_DEVICE_TYPE_GPU, 1, &_device, NULL);
-    checkError(err, "clGetDeviceIDs");
+//~~~~~ Allocate page-aligned host memory that USE_HOST_PTR buffers can wrap ~~~~~~~~~~~~~~~~~~~~~~
 
-    // Create context
-    _context = clCreateContext(NULL, 1, &_device, NULL, NULL, &err);
-    checkError(err, "clCreateContext");
+void* OpenCL::allocHostMemory(size_t bytes)
+{
+    const size_t page = 4096;
+    void* memory = aligned_alloc(page, (bytes + page - 1) / page * page);
+    if (!memory) throw OpenClError("Failed to allocate host memory");
+    return memory;
+}
 
-    // Create command queue
-    _queue = clCreateCommandQueueWithProperties(_context, _device, NULL, &err);
-    checkError(err, "clCreateCommandQueueWithProperties");
+void OpenCL::freeHostMemory(void* memory)
+{
+    free(memory);
+}
 
-    // Create program
-    char* kernelSource = loadKernelSource(kernelSourceFile);
-    _program = clCreateProgramWithSource(_context, 1, (const char**)&kernelSource, NULL, &err);
-    free(kernelSource);
-    checkError(err, "clCreateProgramWithSource");
+//~~~~~ Copy between host array and host-mapped buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-    // Build program
-    err = clBuildProgram(_program, 1, &_device, NULL, NULL, NULL);
-    if (err != CL_SUCCESS)
+// For buffers wrapping the same host array the map only synchronizes and nothing is copied
+
+void OpenCL::mapCopy(const Buffer& buffer, void* value, size_t bytes, bool toDevice)
+{
+    cl_int err;
+    cl_event event = nullptr;
+    cl_map_flags flags = toDevice ? ((buffer.flags & CL_MEM_USE_HOST_PTR) ? CL_MAP_WRITE : CL_MAP_WRITE_INVALIDATE_REGION) : CL_MAP_READ;
+    void* mapped = clEnqueueMapBuffer(_context->queue(), buffer.mem, CL_TRUE, flags, 0, bytes, 0, NULL, profileEvent(event), &err);
+    checkError(err, "clEnqueueMapBuffer");
+    trackEvent(toDevice ? "map host->device" : "map device->host", event, bytes);
+    if (mapped != value)
     {
-        size_t log_size;
-        clGetProgramBuildInfo(_program, _device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *log = (char *)malloc(log_size);
-        clGetProgramBuildInfo(_program, _device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        std::string errorMsg = "Build error" + std::string(log);
-        free(log);
-        throw OpenClError(errorMsg);
+        if (toDevice) memcpy(mapped, value, bytes);
+        else memcpy(value, mapped, bytes);
     }
+    err = clEnqueueUnmapMemObject(_context->queue(), buffer.mem, mapped, 0, NULL, profileEvent(event));
+    checkError(err, "clEnqueueUnmapMemObject");
+    trackEvent("unmap", event);
+}
+
+//~~~~~ Create buffer for kernel argument ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-    // Create kernels
+// Every argument gets a slot in _buffers, scalar and local arguments an empty one, so buffers
+// are found by argument position
 
-    for (const auto& kernelName : kernelNames)
+void OpenCL::createBuffer(const KernelArg& arg)
+{
+    cl_int err;
+    Buffer buffer;
+    if (arg.kind != KernelArg::BUFFER || !arg.bytes)
     {
-        cl_kernel kernel = clCreateKernel(_program, kernelName.c_str(), &err);
-        checkError(err, "clCreateKernel");
-        _kernels.push_back(kernel);
+        _buffers.push_back(buffer);
+        return;
+    }
+
+    HostMemory mode = _hostMemory;
+    if (mode == HostMemory::USE_HOST_PTR && ((size_t)arg.data % 4096 != 0 || !arg.data)) mode = HostMemory::ALLOC_HOST_PTR;
+
+    switch (mode)
+    {
+        case HostMemory::USE_HOST_PTR:
+            buffer.flags = argMemFlags(arg) | CL_MEM_USE_HOST_PTR;
+            buffer.bytes = arg.bytes;
+            buffer.pooled = false;
+            buffer.mem = clCreateBuffer(_context->context(), buffer.flags, arg.bytes, arg.data, &err);
+            checkError(err, "clCreateBuffer");
+            _buffers.push_back(buffer);
+            break;
+        case HostMemory::ALLOC_HOST_PTR:
+            buffer = _context->acquireBuffer(argMemFlags(arg) | CL_MEM_ALLOC_HOST_PTR, arg.bytes);
+            _buffers.push_back(buffer);
+            if (arg.input) mapCopy(buffer, arg.data, arg.bytes, true);
+            break;
+        default:
+        {
+            cl_event event = nullptr;
+            buffer = _context->acquireBuffer(argMemFlags(arg), arg.bytes);
+            _buffers.push_back(buffer);
+            if (!arg.input) break;
+            err = clEnqueueWriteBuffer(_context->queue(), buffer.mem, CL_TRUE, 0, arg.bytes, arg.data, 0, NULL, profileEvent(event));
+            checkError(err, "clEnqueueWriteBuffer");
+            trackEvent("write host->device", event, arg.bytes);
+        }
     }
 }
 
-//~~~~~ Release OpenCL resources ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~ Copy input argument to its buffer or output buffer to its argument ~~~~~~~~~~~~~~~~~~~~~~~
 
-void OpenCL::release() 
+void OpenCL::transferBuffer(size_t index, const KernelArg& arg, bool toDevice)
 {
-    for (const auto &kernel : _kernels) clReleaseKernel(kernel);
-    _kernels.clear();
-    if (_program)  clReleaseProgram(_program);
-    if (_queue)   clReleaseCommandQueue(_queue);
-    if (_context) clReleaseContext(_context);
-    freeBuffers();
-}
+    if (arg.kind != KernelArg::BUFFER || !arg.bytes || !(toDevice ? arg.input : arg.output)) return;
+    if (index >= _buffers.size() || !_buffers[index].mem || _buffers[index].bytes < arg.bytes)
+        throw OpenClError("Argument " + std::to_string(index) + " does not match created buffers");
 
-/**************************************************************************************************
- * OpenCL buffer management
- *
- * This section contains functions to create, read, and free OpenCL buffers.
- * The buffers are created based on the argument types specified in the run method.
- * The buffers are automatically freed after use.
- *
- **************************************************************************************************/
+    cl_int err;
+    cl_event event = nullptr;
+    const Buffer& buffer = _buffers[index];
+    if (buffer.flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)) mapCopy(buffer, arg.data, arg.bytes, toDevice);
+    else if (toDevice)
+    {
+        err = clEnqueueWriteBuffer(_context->queue(), buffer.mem, CL_TRUE, 0, arg.bytes, arg.data, 0, NULL, profileEvent(event));
+        checkError(err, "clEnqueueWriteBuffer");
+        trackEvent("write host->device", event, arg.bytes);
+    }
+    else
+    {
+        err = clEnqueueReadBuffer(_context->queue(), buffer.mem, CL_TRUE, 0, arg.bytes, arg.data, 0, NULL, profileEvent(event));
+        checkError(err, "clEnqueueReadBuffer");
+        trackEvent("read device->host", event, arg.bytes);
+    }
+}
 
 //~~~~~ Create buffers for kernel arguments ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-void OpenCL::createBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args) 
+void OpenCL::createBuffers(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args) 
 {
+    freeBuffers();
     try {
-        cl_int err;
-        freeBuffers();
-        for (const auto& arg : args)
-        {
-            cl_mem buffer;
-            ArgTypes type = std::get<0>(arg);
-            void* value = std::get<1>(arg);
-            size_t size = std::get<2>(arg);
-
-            switch (type)
-            {
-                case ArgTypes::IN_IBUF:
-                    buffer = clCreateBuffer(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int) * size, value, &err);
-                    break;
-                case ArgTypes::OUT_IBUF:
-                    buffer = clCreateBuffer(_context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(int) * size, NULL, &err);
-                    break;
-                case ArgTypes::IN_OUT_IBUF:
-                    buffer = clCreateBuffer(_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(int) * size, value, &err);
-                    break;
-                case ArgTypes::IN_FBUF:
-                    buffer = clCreateBuffer(_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * size, value, &err);
-                    break;
-                case ArgTypes::OUT_FBUF:
-                    buffer = clCreateBuffer(_context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, sizeof(float) * size, NULL, &err);
-                    break;
-                case ArgTypes::IN_OUT_FBUF:
-                    buffer = clCreateBuffer(_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(float) * size, value, &err);
-                    break;
-                default:
-                    buffer = 0;
-                    err = CL_SUCCESS;
-            }
-            checkError(err, "clCreateBuffer");
-            _buffers.push_back(buffer);
-        }
+        for (const auto& arg : args) createBuffer(toKernelArg(arg));
     }
     catch (...) {
         freeBuffers();
@@ -201,69 +232,95 @@ void OpenCL::createBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args
     }
 }
 
-//~~~~~ Write buffer to OpenCL device ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//~~~~~ Write input buffers to OpenCL device ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-void  OpenCL::writeBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args)
+// Only IN_IBUF and IN_FBUF arguments are written, IN_OUT buffers keep their device content
+
+void  OpenCL::writeBuffers(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args)
 {
-    cl_int err;
-    for (int index = 0; index < args.size(); index++)
+    for (size_t index = 0; index < args.size(); index++)
     {
-        auto arg = args[index];
-        ArgTypes type = std::get<0>(arg);
-        void* value = std::get<1>(arg);
-        size_t size = std::get<2>(arg);
-
-        switch (type) {
-            case ArgTypes::IN_IBUF:
-                err = clEnqueueWriteBuffer(_queue, _buffers[index], CL_TRUE, 0, sizeof(int) * size, value, 0, NULL, NULL);
-                break;
-            case ArgTypes::IN_FBUF:
-                err = clEnqueueWriteBuffer(_queue, _buffers[index], CL_TRUE, 0, sizeof(float) * size, value, 0, NULL, NULL);
-                break;
-            default:
-                err = CL_SUCCESS;
-        }
-
-        checkError(err, "clEnqueueReadBuffer");
+        KernelArg arg = toKernelArg(args[index]);
+        if (!arg.output) transferBuffer(index, arg, true);
     }
 }
 
 //~~~~~ Read buffers after kernel execution ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-void OpenCL::readBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args) 
+void OpenCL::readBuffers(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args) 
 {
-    cl_int err;
-    for (int index = 0; index < args.size(); index++)
-    {
-        auto arg = args[index];
-        ArgTypes type = std::get<0>(arg);
-        void* value = std::get<1>(arg);
-        size_t size = std::get<2>(arg);
-
-        switch (type) {
-            case ArgTypes::OUT_IBUF:
-            case ArgTypes::IN_OUT_IBUF:
-                err = clEnqueueReadBuffer(_queue, _buffers[index], CL_TRUE, 0, sizeof(int) * size, value, 0, NULL, NULL);
-                break;
-            case ArgTypes::OUT_FBUF:
-            case ArgTypes::IN_OUT_FBUF:
-                err = clEnqueueReadBuffer(_queue, _buffers[index], CL_TRUE, 0, sizeof(float) * size, value, 0, NULL, NULL);
-                break;
-            default:
-                err = CL_SUCCESS;
-        }
-
-        checkError(err, "clEnqueueReadBuffer");
-    }
+    for (size_t index = 0; index < args.size(); index++) transferBuffer(index, toKernelArg(args[index]), false);
 }
 
 //~~~~~ Free OpenCL buffers ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 void OpenCL::freeBuffers() {
-    for (auto buffer : _buffers) if (buffer) clReleaseMemObject(buffer);
+    for (const auto& buffer : _buffers) _context->recycleBuffer(buffer);
     _buffers.clear();
 }
 
+//~~~~~ Wait for all enqueued commands ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::finish()
+{
+    checkError(clFinish(_context->queue()), "clFinish");
+    recycleInflight(true);
+}
+
+/**************************************************************************************************
+ * OpenCL device buffers
+ *
+ * Device buffers belong to the context (see context.cpp). A kernel binds a device buffer
+ * wherever it appears in its argument list, and jobs transfer data to and from it.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Use device buffer as kernel argument ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+KernelArg OpenCL::toArg(const DeviceBuffer& buffer)
+{
+    if (!buffer) throw OpenClError("Device buffer " + buffer.name() + " is empty");
+    KernelArg arg;
+    arg.kind = KernelArg::DEVICE;
+    arg.element = arg.bytes = sizeof(cl_mem);
+    cl_mem mem = buffer.mem();
+    memcpy(arg.value, &mem, sizeof(cl_mem));
+    return arg;
+}
+
+//~~~~~ Copy host data to device buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::writeBytes(const DeviceBuffer& buffer, const void* data, size_t bytes, size_t offset)
+{
+    if (!buffer || offset + bytes > buffer.bytes()) throw OpenClError("Write outside of device buffer " + buffer.name());
+    cl_event event = nullptr;
+    cl_int err = clEnqueueWriteBuffer(_context->queue(), buffer.mem(), CL_TRUE, offset, bytes, data, 0, NULL, profileEvent(event));
+    checkError(err, "clEnqueueWriteBuffer");
+    trackEvent("write host->device", event, bytes);
+}
+
+//~~~~~ Copy device buffer to host data ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::readBytes(const DeviceBuffer& buffer, void* data, size_t bytes, size_t offset)
+{
+    if (!buffer || offset + bytes > buffer.bytes()) throw OpenClError("Read outside of device buffer " + buffer.name());
+    cl_event event = nullptr;
+    cl_int err = clEnqueueReadBuffer(_context->queue(), buffer.mem(), CL_TRUE, offset, bytes, data, 0, NULL, profileEvent(event));
+    checkError(err, "clEnqueueReadBuffer");
+    trackEvent("read device->host", event, bytes);
+}
+
+//~~~~~ Copy device buffer to another one on the device ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::copy(const DeviceBuffer& from, const DeviceBuffer& to)
+{
+    if (!from || !to || from.bytes() > to.bytes()) throw OpenClError("Device buffer " + from.name() + " does not fit into " + to.name());
+    cl_event event = nullptr;
+    cl_int err = clEnqueueCopyBuffer(_context->queue(), from.mem(), to.mem(), 0, 0, from.bytes(), 0, NULL, profileEvent(event));
+    checkError(err, "clEnqueueCopyBuffer");
+    trackEvent("copy device->device", event, from.bytes());
+}
+
 /**************************************************************************************************
  * OpenCL kernel execution
  *
@@ -272,55 +329,301 @@ void OpenCL::freeBuffers() {
  *
  **************************************************************************************************/
 
-void OpenCL::runKernel(int idKkernel, std::vector<std::tuple<ArgTypes, void*, size_t>> args, const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize) 
+//~~~~~ Work size from lists of global and local sizes ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+NDRange::NDRange(std::initializer_list<size_t> globalSize, std::initializer_list<size_t> localSize)
 {
-    cl_int err;
-    cl_kernel kernel = _kernels[idKkernel];
-    if (!kernel) throw OpenClError("Kernel not found");
+    if (globalSize.size() < 1 || globalSize.size() > 3) throw OpenClError("Work size must have 1 to 3 dimensions");
+    if (localSize.size() && localSize.size() != globalSize.size()) throw OpenClError("Local size must match global size dimensions");
+    dims = (cl_uint)globalSize.size();
+    std::copy(globalSize.begin(), globalSize.end(), global);
+    std::copy(localSize.begin(), localSize.end(), local);
+    hasLocal = localSize.size() > 0;
+}
 
-    // Set kernel arguments
+NDRange::NDRange(const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize)
+{
+    if (globalSize.size() < 1 || globalSize.size() > 3) throw OpenClError("Work size must have 1 to 3 dimensions");
+    if (localSize.size() && localSize.size() != globalSize.size()) throw OpenClError("Local size must match global size dimensions");
+    dims = (cl_uint)globalSize.size();
+    std::copy(globalSize.begin(), globalSize.end(), global);
+    std::copy(localSize.begin(), localSize.end(), local);
+    hasLocal = !localSize.empty();
+}
+
+//~~~~~ Bind kernel argument ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-    for (int index = 0; index < args.size(); index++)
+void OpenCL::bindArg(int idKernel, cl_uint index, const KernelArg& arg)
+{
+    switch (arg.kind)
     {
-        auto arg = args[index];
-        ArgTypes type = std::get<0>(arg);
-        void* value = std::get<1>(arg);
-        size_t size = std::get<2>(arg);
+        case KernelArg::SCALAR:
+            setKernelArg(idKernel, index, arg.bytes, arg.value, false);
+            break;
+        case KernelArg::DEVICE:
+            setKernelArg(idKernel, index, arg.bytes, arg.value, true);
+            break;
+        case KernelArg::LOCAL:
+            setKernelArg(idKernel, index, arg.bytes, NULL, false);
+            break;
+        default:
+            if (index >= _buffers.size() || !_buffers[index].mem) throw OpenClError("Argument " + std::to_string(index) + " has no buffer");
+            setKernelArg(idKernel, index, sizeof(cl_mem), &_buffers[index].mem, true);
+    }
+}
+
+//~~~~~ Set kernel argument through the binding cache and count driver calls ~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::setKernelArg(int idKernel, cl_uint index, size_t size, const void* value, bool memory)
+{
+    _bindingStats.requested++;
+    if (_kernels.at(idKernel).setArg(index, size, value, memory ? _context->memoryEpoch() : 0)) _bindingStats.issued++;
+}
+
+//~~~~~ Enqueue kernel with bound arguments ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::enqueueKernel(int idKernel, const NDRange& range)
+{
+    const Kernel& kernel = _kernels.at(idKernel);
+    if (!kernel.bound()) throw OpenClError("Kernel " + kernel.name() + " has unbound arguments");
+    _bindingStats.launches++;
+    cl_event event = nullptr;
+    cl_int err = clEnqueueNDRangeKernel(_context->queue(), kernel.kernel(), range.dims, NULL, range.global, range.hasLocal ? range.local : NULL, 0, NULL, profileEvent(event));
+    checkError(err, "clEnqueueNDRangeKernel");
+    if (event) trackEvent("kernel " + kernel.name(), event);
+}
+
+//~~~~~ Enqueue kernel with bound arguments on queue after events, returns event of the launch ~~~~
 
-        switch (type)
+cl_event OpenCL::enqueueKernelOn(cl_command_queue queue, int idKernel, const NDRange& range, const std::vector<cl_event>& waitList)
+{
+    const Kernel& kernel = _kernels.at(idKernel);
+    if (!kernel.bound()) throw OpenClError("Kernel " + kernel.name() + " has unbound arguments");
+    _bindingStats.launches++;
+    cl_event event = nullptr;
+    cl_int err = clEnqueueNDRangeKernel(queue, kernel.kernel(), range.dims, NULL, range.global, range.hasLocal ? range.local : NULL,
+        (cl_uint)waitList.size(), waitList.empty() ? NULL : waitList.data(), &event);
+    checkError(err, "clEnqueueNDRangeKernel");
+    return event;
+}
+
+//~~~~~ Run kernel with arguments ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::runKernel(int idKkernel, const std::vector<std::tuple<ArgTypes, void*, size_t>>& args, const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize) 
+{
+    for (size_t index = 0; index < args.size(); index++) bindArg(idKkernel, (cl_uint)index, toKernelArg(args[index]));
+    enqueueKernel(idKkernel, NDRange(globalSize, localSize));
+}
+
+/**************************************************************************************************
+ * Local work size tuning
+ *
+ * Candidate local sizes are timed on the bound arguments and the fastest one is stored in the
+ * tuning database under the device, driver, kernel, build options and global range, so the next
+ * run with the same shape looks it up without launching anything.
+ *
+ **************************************************************************************************/
+
+static const int TUNING_RUNS = 3;   // timed runs per candidate after one warm-up run
+
+//~~~~~ Tune local work size of kernel for global range ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// The kernel runs (TUNING_RUNS + 1) times per candidate, so the bound buffers it may write are
+// backed up first and copied back before every run and after tuning: each run sees the same data
+// and the kernel need not be idempotent. Kernel time comes from profiling events when the queue
+// has profiling enabled and from the host clock around clFinish otherwise. Sizes the driver
+// rejects are skipped
+
+NDRange OpenCL::tuneLocalSize(int idKernel, const NDRange& range)
+{
+    const Kernel& kernel = _kernels.at(idKernel);
+    if (!kernel.bound()) throw OpenClError("Kernel " + kernel.name() + " has unbound arguments");
+    const DeviceInfo& device = _context->deviceInfo();
+
+    std::string key = device.name + " | " + device.driverVersion + " | " + kernel.name() + " | " + _program->options() + " |";
+    for (cl_uint d = 0; d < range.dims; d++) key += " " + std::to_string(range.global[d]);
+    if (range.hasLocal) for (cl_uint d = 0; d < range.dims; d++) key += (d ? " " : " | max ") + std::to_string(range.local[d]);
+
+    NDRange tuned = range;
+    tuned.hasLocal = true;
+    TuningResult result;
+    TuningDB& db = TuningDB::global();
+    if (db.find(key, result) && result.dims == range.dims)
+    {
+        std::copy(result.local, result.local + 3, tuned.local);
+        return tuned;
+    }
+
+    TimeSpan span("tune " + kernel.name());
+    std::vector<size_t> maxItems = device.maxWorkItemSizes;
+    if (range.hasLocal)
+    {
+        if (maxItems.size() < range.dims) maxItems.resize(range.dims, 0);
+        for (cl_uint d = 0; d < range.dims; d++) maxItems[d] = maxItems[d] ? std::min(maxItems[d], range.local[d]) : range.local[d];
+    }
+    auto candidates = localSizeCandidates(range.dims, range.global, kernel.workGroupSize(), kernel.preferredWorkGroupMultiple(), maxItems);
+    result.dims = range.dims;
+    result.ms = std::numeric_limits<double>::infinity();
+    cl_command_queue queue = _context->queue();
+
+    std::vector<std::pair<cl_mem, Buffer>> backups;     // writable bound buffers and their copies
+    auto restore = [&]() {
+        for (const auto& backup : backups)
+            checkError(clEnqueueCopyBuffer(queue, backup.second.mem, backup.first, 0, 0, backup.second.bytes, 0, NULL, NULL), "clEnqueueCopyBuffer");
+        checkError(clFinish(queue), "clFinish");
+    };
+
+    try {
+        for (cl_mem mem : kernel.boundBuffers())
+        {
+            cl_mem_flags flags = 0;
+            size_t bytes = 0;
+            checkError(clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(flags), &flags, NULL), "clGetMemObjectInfo");
+            checkError(clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(bytes), &bytes, NULL), "clGetMemObjectInfo");
+            if (flags & CL_MEM_READ_ONLY) continue;
+            backups.emplace_back(mem, _context->acquireBuffer(CL_MEM_READ_WRITE, bytes));
+            checkError(clEnqueueCopyBuffer(queue, mem, backups.back().second.mem, 0, 0, bytes, 0, NULL, NULL), "clEnqueueCopyBuffer");
+        }
+
+        for (const auto& local : candidates)
         {
-            case ArgTypes::INT:
-                err = clSetKernelArg(kernel, index, sizeof(int), value);
-                break;
-            case ArgTypes::IN_IBUF:
-            case ArgTypes::OUT_IBUF:
-            case ArgTypes::IN_OUT_IBUF:
-            case ArgTypes::IN_FBUF:
-            case ArgTypes::OUT_FBUF:
-            case ArgTypes::IN_OUT_FBUF:
-                err = clSetKernelArg(kernel, index, sizeof(cl_mem), &_buffers[index]);
-                break;
-            default:
-                throw OpenClError("Invalid argument type");
+            double best = std::numeric_limits<double>::infinity();
+            for (int run = 0; run <= TUNING_RUNS; run++)
+            {
+                restore();
+                cl_event event = nullptr;
+                Timer timer;
+                cl_int err = clEnqueueNDRangeKernel(queue, kernel.kernel(), range.dims, NULL, range.global, local.data(), 0, NULL, _profiling ? &event : NULL);
+                if (err != CL_SUCCESS) break;
+                checkError(clFinish(queue), "clFinish");
+                double ms = timer.ms();
+                if (event)
+                {
+                    cl_ulong start = 0, end = 0;
+                    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS
+                        && clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS) ms = (end - start) * 1e-6;
+                    clReleaseEvent(event);
+                }
+                if (run > 0) best = std::min(best, ms);
+            }
+            if (best < result.ms)
+            {
+                result.ms = best;
+                std::copy(local.begin(), local.end(), result.local);
+            }
         }
-        checkError(err, "clSetKernelArg");
+        restore();
     }
+    catch (...) {
+        clFinish(queue);
+        for (const auto& backup : backups) _context->recycleBuffer(backup.second);
+        throw;
+    }
+    for (const auto& backup : backups) _context->recycleBuffer(backup.second);
+    if (result.ms == std::numeric_limits<double>::infinity()) throw OpenClError("No local size runs kernel " + kernel.name());
+
+    db.store(key, result);
+    std::copy(result.local, result.local + 3, tuned.local);
+    return tuned;
+}
+
+/**************************************************************************************************
+ * OpenCL profiling
+ *
+ * When profiling is enabled, the command queue is created with CL_QUEUE_PROFILING_ENABLE and
+ * every transfer and kernel launch gets an event. Events are collected lazily and their
+ * timestamps are aggregated per kernel name and per transfer direction.
+ *
+ **************************************************************************************************/
 
-    // Execute kernel
+//~~~~~ Get event slot for an enqueue call, NULL when profiling is off ~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-    cl_uint workDim = static_cast<cl_uint>(globalSize.size());
-    size_t *workSize = new size_t[workDim]; 
-    for (cl_uint i = 0; i < workDim; i++) workSize[i] = globalSize[i];
-    size_t *groupSize = NULL;
-    if (!localSize.empty())
+cl_event* OpenCL::profileEvent(cl_event& event)
+{
+    event = nullptr;
+    return _profiling ? &event : NULL;
+}
+
+//~~~~~ Remember event until its timestamps are collected ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::trackEvent(const std::string& name, cl_event event, size_t bytes)
+{
+    if (!event) return;
+    _pendingEvents.emplace_back(name, event, bytes);
+    if (_pendingEvents.size() >= 4096) collectProfile();
+}
+
+//~~~~~ Wait for pending events and aggregate their timestamps ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::collectProfile()
+{
+    std::vector<std::tuple<std::string, cl_event, size_t>> pending;
+    pending.swap(_pendingEvents);
+    try {
+        for (const auto& entry : pending)
+        {
+            cl_event event = std::get<1>(entry);
+            cl_ulong queued, submit, start, end;
+            checkError(clWaitForEvents(1, &event), "clWaitForEvents");
+            checkError(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL), "clGetEventProfilingInfo");
+            checkError(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL), "clGetEventProfilingInfo");
+            checkError(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL), "clGetEventProfilingInfo");
+            checkError(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL), "clGetEventProfilingInfo");
+
+            ProfileStats& stats = _profile[std::get<0>(entry)];
+            cl_ulong time = end - start;
+            if (stats.count == 0 || time < stats.min) stats.min = time;
+            if (time > stats.max) stats.max = time;
+            stats.count++;
+            stats.total += time;
+            stats.bytes += std::get<2>(entry);
+            stats.queued += submit - queued;
+            stats.submitted += start - submit;
+        }
+    }
+    catch (...) {
+        for (const auto& entry : pending) clReleaseEvent(std::get<1>(entry));
+        throw;
+    }
+    for (const auto& entry : pending) clReleaseEvent(std::get<1>(entry));
+}
+
+//~~~~~ Get aggregated profile ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+const std::map<std::string, ProfileStats>& OpenCL::profile()
+{
+    collectProfile();
+    return _profile;
+}
+
+//~~~~~ Clear aggregated profile ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::resetProfile()
+{
+    collectProfile();
+    _profile.clear();
+    _bindingStats = ArgBindingStats();
+}
+
+//~~~~~ Print aggregated profile ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void OpenCL::printProfile()
+{
+    collectProfile();
+    printf("\n~~~~~ OpenCL profile (ms)\n");
+    printf("%-28s %8s %10s %10s %10s %10s %10s %10s\n", "command", "count", "total", "min", "mean", "max", "wait", "GB/s");
+    for (const auto& entry : _profile)
     {
-        groupSize = new size_t[workDim];
-        for (cl_uint i = 0; i < workDim; i++) groupSize[i] = localSize[i];
+        const ProfileStats& stats = entry.second;
+        double wait = (stats.queued + stats.submitted) * 1e-6;
+        printf("%-28s %8zu %10.3f %10.3f %10.3f %10.3f %10.3f", entry.first.c_str(), stats.count,
+            stats.total * 1e-6, stats.min * 1e-6, stats.mean() * 1e-6, stats.max * 1e-6, wait);
+        if (stats.bytes && stats.total) printf(" %10.2f\n", (double)stats.bytes / stats.total);
+        else printf(" %10s\n", "-");
     }
-    err = clEnqueueNDRangeKernel(_queue, kernel, workDim, NULL, workSize, groupSize, 0, NULL, NULL);
-    delete[] workSize;
-    if (groupSize) delete[] groupSize;
-    checkError(err, "clEnqueueNDRangeKernel");
+    const ArgBindingStats& calls = _bindingStats;
+    printf("driver calls: %zu clEnqueueNDRangeKernel, %zu clSetKernelArg (%zu requested, %zu skipped as already bound)\n",
+        calls.launches, calls.issued, calls.requested, calls.requested - calls.issued);
 }
 
 /**************************************************************************************************
@@ -333,7 +636,7 @@ void OpenCL::runKernel(int idKkernel, std::vector<std::tuple<ArgTypes, void*, si
 **************************************************************************************************/
 
 void OpenCL::run(
-    std::vector<std::tuple<ArgTypes, void*, size_t>> args,
+    const std::vector<std::tuple<ArgTypes, void*, size_t>>& args,
     const std::vector<size_t>& globalSize,
     const std::vector<size_t>& localSize
 )
@@ -349,3 +652,296 @@ void OpenCL::run(
         throw;
     }
 }
+
+/**************************************************************************************************
+ * OpenCL asynchronous methods
+ *
+ * Every command gets an event that backs its future, and the events of the dependencies form its
+ * wait list. Commands of runAsync are chained by their events as well, so the order holds on
+ * out-of-order queues too. The queue is flushed after each call, so the commands start and the
+ * completion callbacks fire without a later blocking call.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Wrap event of an enqueued command in a future, profiled jobs also track it ~~~~~~~~~~~~~~~~
+
+JobFuture OpenCL::asyncFuture(const std::string& name, cl_event event, size_t bytes)
+{
+    JobFuture future(event);
+    if (_profiling && clRetainEvent(event) == CL_SUCCESS) trackEvent(name, event, bytes);
+    return future;
+}
+
+//~~~~~ Copy host data to device buffer without waiting ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+JobFuture OpenCL::writeAsyncBytes(const DeviceBuffer& buffer, const void* data, size_t bytes, const Dependencies& after)
+{
+    if (!buffer || bytes > buffer.bytes()) throw OpenClError("Write outside of device buffer " + buffer.name());
+    std::vector<cl_event> events = waitList(after);
+    cl_event event = nullptr;
+    cl_int err = clEnqueueWriteBuffer(_context->queue(), buffer.mem(), CL_FALSE, 0, bytes, data, (cl_uint)events.size(), events.empty() ? NULL : events.data(), &event);
+    checkError(err, "clEnqueueWriteBuffer");
+    JobFuture future = asyncFuture("write host->device", event, bytes);
+    checkError(clFlush(_context->queue()), "clFlush");
+    return future;
+}
+
+//~~~~~ Copy device buffer to host data without waiting ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+JobFuture OpenCL::readAsyncBytes(const DeviceBuffer& buffer, void* data, size_t bytes, const Dependencies& after)
+{
+    if (!buffer || bytes > buffer.bytes()) throw OpenClError("Read outside of device buffer " + buffer.name());
+    std::vector<cl_event> events = waitList(after);
+    cl_event event = nullptr;
+    cl_int err = clEnqueueReadBuffer(_context->queue(), buffer.mem(), CL_FALSE, 0, bytes, data, (cl_uint)events.size(), events.empty() ? NULL : events.data(), &event);
+    checkError(err, "clEnqueueReadBuffer");
+    JobFuture future = asyncFuture("read device->host", event, bytes);
+    checkError(clFlush(_context->queue()), "clFlush");
+    return future;
+}
+
+//~~~~~ Enqueue kernel with bound arguments after dependencies ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+JobFuture OpenCL::launchAsyncBound(int idKernel, const NDRange& range, const Dependencies& after)
+{
+    cl_event event = enqueueKernelOn(_context->queue(), idKernel, range, waitList(after));
+    JobFuture future = asyncFuture("kernel " + _kernels[idKernel].name(), event);
+    checkError(clFlush(_context->queue()), "clFlush");
+    return future;
+}
+
+//~~~~~ Upload, run all kernels and download without waiting ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Buffer arguments get pooled device buffers of their own, so several runs may be in flight.
+// The future of the last command completes the run, the buffers are recycled after it
+
+JobFuture OpenCL::runAsyncArgs(const NDRange& range, const Dependencies& after, const std::vector<KernelArg>& args)
+{
+    if (_kernels.empty()) throw OpenClError("Job has no kernels to run");
+    recycleInflight(false);
+    std::vector<Buffer> buffers;
+    try {
+        std::vector<KernelArg> bound(args);
+        Dependencies uploads;
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            const KernelArg& arg = args[i];
+            if (arg.kind != KernelArg::BUFFER || !arg.bytes) continue;
+            buffers.push_back(_context->acquireBuffer(argMemFlags(arg), arg.bytes));
+            const Buffer& buffer = buffers.back();
+            bound[i] = KernelArg();
+            bound[i].kind = KernelArg::DEVICE;
+            bound[i].element = bound[i].bytes = sizeof(cl_mem);
+            memcpy(bound[i].value, &buffer.mem, sizeof(cl_mem));
+            if (!arg.input) continue;
+
+            std::vector<cl_event> events = waitList(after);
+            cl_event event = nullptr;
+            cl_int err = clEnqueueWriteBuffer(_context->queue(), buffer.mem, CL_FALSE, 0, arg.bytes, arg.data, (cl_uint)events.size(), events.empty() ? NULL : events.data(), &event);
+            checkError(err, "clEnqueueWriteBuffer");
+            uploads.push_back(asyncFuture("write host->device", event, arg.bytes));
+        }
+
+        Dependencies previous = uploads.empty() ? after : uploads;
+        for (int k = 0; k < (int)_kernels.size(); k++)
+        {
+            for (cl_uint index = 0; index < bound.size(); index++) bindArg(k, index, bound[index]);
+            previous = { launchAsyncBound(k, range, previous) };
+        }
+
+        Dependencies downloads;
+        for (size_t i = 0; i < args.size(); i++)
+        {
+            const KernelArg& arg = args[i];
+            if (arg.kind != KernelArg::BUFFER || !arg.bytes || !arg.output) continue;
+            cl_mem mem;
+            memcpy(&mem, bound[i].value, sizeof(cl_mem));
+            std::vector<cl_event> events = waitList(previous);
+            cl_event event = nullptr;
+            cl_int err = clEnqueueReadBuffer(_context->queue(), mem, CL_FALSE, 0, arg.bytes, arg.data, (cl_uint)events.size(), events.empty() ? NULL : events.data(), &event);
+            checkError(err, "clEnqueueReadBuffer");
+            downloads.push_back(asyncFuture("read device->host", event, arg.bytes));
+        }
+
+        JobFuture done = previous.front();
+        if (downloads.size() == 1) done = downloads.front();
+        else if (downloads.size() > 1)
+        {
+            std::vector<cl_event> events = waitList(downloads);
+            cl_event event = nullptr;
+            checkError(clEnqueueMarkerWithWaitList(_context->queue(), (cl_uint)events.size(), events.data(), &event), "clEnqueueMarkerWithWaitList");
+            done = JobFuture(event);
+        }
+        checkError(clFlush(_context->queue()), "clFlush");
+        _inflight.emplace_back(done, std::move(buffers));
+        return done;
+    }
+    catch (...) {
+        // commands enqueued before the failure may still use the buffers
+        clFinish(_context->queue());
+        for (const auto& buffer : buffers) _context->recycleBuffer(buffer);
+        throw;
+    }
+}
+
+//~~~~~ Recycle buffers of completed asynchronous runs, or of all after the queue finished ~~~~~~~~~
+
+void OpenCL::recycleInflight(bool all)
+{
+    for (auto it = _inflight.begin(); it != _inflight.end();)
+    {
+        if (!all && !it->first.ready()) { ++it; continue; }
+        for (const auto& buffer : it->second) _context->recycleBuffer(buffer);
+        it = _inflight.erase(it);
+    }
+}
+
+/**************************************************************************************************
+ * OpenCL streamed run method
+ *
+ * This method runs element-wise kernels over 1D buffers of any length. The buffers are split
+ * into chunks, and two device buffer sets are used alternately: while chunk i is computed on the
+ * main queue, chunk i+1 is uploaded and chunk i-1 is downloaded on a separate transfer queue.
+ * Events order the commands between the queues. Every kernel is launched once per chunk with
+ * the global size equal to the chunk length, and scalar arguments are passed unchanged, so
+ * kernels must process element get_global_id(0) of each buffer.
+ *
+ **************************************************************************************************/
+
+void OpenCL::runStreamed(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args, size_t chunkSize)
+{
+    std::vector<KernelArg> typed;
+    for (const auto& arg : args) typed.push_back(toKernelArg(arg));
+    runStreamed(typed, chunkSize);
+}
+
+void OpenCL::runStreamed(const std::vector<KernelArg>& args, size_t chunkSize)
+{
+    const int SETS = 2;
+    cl_int err;
+
+    // All buffer arguments must have the same length
+
+    size_t length = 0, maxElement = 0;
+    for (const auto& arg : args)
+    {
+        if (arg.kind != KernelArg::BUFFER) continue;
+        size_t count = arg.bytes / arg.element;
+        if (length && count != length) throw OpenClError("Streamed buffers must have equal size");
+        length = count;
+        if (arg.element > maxElement) maxElement = arg.element;
+    }
+    if (!length) return;
+    if (!chunkSize) chunkSize = std::min<size_t>(8 << 20, _context->maxAllocSize() / maxElement);
+    chunkSize = std::min(chunkSize, length);
+
+    cl_command_queue transferQueue = _context->transferQueue();
+
+    std::vector<Buffer> sets[SETS];
+    std::vector<std::tuple<std::string, cl_event, size_t>> events;  // all issued events, released at the end
+    cl_event downloaded[SETS] = {};                                  // last download from each set
+
+    auto issue = [&](const std::string& name, cl_event event, size_t bytes) {
+        events.emplace_back(name, event, bytes);
+        return event;
+    };
+
+    try {
+        for (int set = 0; set < SETS; set++)
+        {
+            for (const auto& arg : args)
+                sets[set].push_back(arg.kind == KernelArg::BUFFER ? _context->acquireBuffer(argMemFlags(arg), arg.element * chunkSize) : Buffer());
+        }
+
+        size_t chunks = (length + chunkSize - 1) / chunkSize;
+        std::vector<std::vector<cl_event>> uploaded(chunks);
+
+        // Upload inputs of a chunk after the previous download from its set has finished
+
+        auto upload = [&](size_t chunk) {
+            int set = chunk % SETS;
+            size_t offset = chunk * chunkSize, count = std::min(chunkSize, length - offset);
+            for (size_t index = 0; index < args.size(); index++)
+            {
+                const KernelArg& arg = args[index];
+                if (arg.kind != KernelArg::BUFFER || !arg.input) continue;
+                cl_event event;
+                err = clEnqueueWriteBuffer(transferQueue, sets[set][index].mem, CL_FALSE, 0, arg.element * count,
+                    (char*)arg.data + arg.element * offset, downloaded[set] ? 1 : 0, downloaded[set] ? &downloaded[set] : NULL, &event);
+                checkError(err, "clEnqueueWriteBuffer");
+                uploaded[chunk].push_back(issue("write host->device", event, arg.element * count));
+            }
+            clFlush(transferQueue);
+        };
+
+        // Download outputs of a chunk once its kernels have finished
+
+        auto download = [&](size_t chunk, cl_event computed) {
+            int set = chunk % SETS;
+            size_t offset = chunk * chunkSize, count = std::min(chunkSize, length - offset);
+            downloaded[set] = computed;
+            for (size_t index = 0; index < args.size(); index++)
+            {
+                const KernelArg& arg = args[index];
+                if (arg.kind != KernelArg::BUFFER || !arg.output) continue;
+                cl_event event;
+                err = clEnqueueReadBuffer(transferQueue, sets[set][index].mem, CL_FALSE, 0, arg.element * count,
+                    (char*)arg.data + arg.element * offset, computed ? 1 : 0, computed ? &computed : NULL, &event);
+                checkError(err, "clEnqueueReadBuffer");
+                downloaded[set] = issue("read device->host", event, arg.element * count);
+            }
+            clFlush(transferQueue);
+        };
+
+        // Transfer queue order is up(0), up(1), down(0), up(2), down(1)..., so the upload of the
+        // next chunk and the download of the previous one overlap the kernels of the current one
+
+        upload(0);
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+        {
+            int set = chunk % SETS;
+            size_t count = std::min(chunkSize, length - chunk * chunkSize);
+            cl_event computed = nullptr;
+            for (size_t k = 0; k < _kernels.size(); k++)
+            {
+                for (size_t index = 0; index < args.size(); index++)
+                {
+                    const KernelArg& arg = args[index];
+                    if (arg.kind == KernelArg::BUFFER) setKernelArg(k, index, sizeof(cl_mem), &sets[set][index].mem, true);
+                    else setKernelArg(k, index, arg.bytes, arg.kind == KernelArg::LOCAL ? NULL : arg.value, arg.kind == KernelArg::DEVICE);
+                }
+                // The first kernel also waits for the download of the chunk that used the set
+                // before, which no upload orders when no buffer argument is an input
+                std::vector<cl_event> wait = uploaded[chunk];
+                if (downloaded[set]) wait.push_back(downloaded[set]);
+                cl_event event;
+                _bindingStats.launches++;
+                err = clEnqueueNDRangeKernel(_context->queue(), _kernels[k].kernel(), 1, NULL, &count, NULL,
+                    k == 0 ? (cl_uint)wait.size() : 0, k == 0 && !wait.empty() ? wait.data() : NULL, &event);
+                checkError(err, "clEnqueueNDRangeKernel");
+                computed = issue("kernel " + _kernels[k].name(), event, 0);
+            }
+            clFlush(_context->queue());
+
+            if (chunk + 1 < chunks) upload(chunk + 1);
+            download(chunk, computed);
+        }
+
+        checkError(clFinish(transferQueue), "clFinish");
+        checkError(clFinish(_context->queue()), "clFinish");
+    }
+    catch (...) {
+        clFinish(transferQueue);
+        clFinish(_context->queue());
+        for (const auto& entry : events) clReleaseEvent(std::get<1>(entry));
+        for (const auto& set : sets) for (const auto& buffer : set) _context->recycleBuffer(buffer);
+        throw;
+    }
+
+    for (const auto& entry : events)
+    {
+        if (_profiling) trackEvent(std::get<0>(entry), std::get<1>(entry), std::get<2>(entry));
+        else clReleaseEvent(std::get<1>(entry));
+    }
+    for (const auto& set : sets) for (const auto& buffer : set) _context->recycleBuffer(buffer);
+}
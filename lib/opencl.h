@@ -2,48 +2,306 @@
 #define OPENCL_H
 
 #include <CL/cl.h>
-#include <stdexcept>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <tuple>
+#include <map>
+#include <array>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+#include "context.h"
+#include "future.h"
+#include "timer.h"
 
 enum class ArgTypes { INT, IN_IBUF, OUT_IBUF, IN_OUT_IBUF, IN_FBUF, OUT_FBUF, IN_OUT_FBUF };
 
-size_t getTime();
+// How buffers created by createBuffers relate to host memory:
+// COPY           - device buffers, data is copied with read/write commands
+// USE_HOST_PTR   - buffers wrap page-aligned host arrays (zero-copy), other arrays use ALLOC_HOST_PTR
+// ALLOC_HOST_PTR - buffers in driver-allocated pinned memory, accessed with map/unmap
+// AUTO           - USE_HOST_PTR when the device shares memory with the host, COPY otherwise
 
-class OpenClError : public std::runtime_error {
-public:
-    OpenClError(cl_int err, const std::string& operation);
-    OpenClError(const std::string& message);
+enum class HostMemory { AUTO, COPY, USE_HOST_PTR, ALLOC_HOST_PTR };
+
+// Typed kernel argument built by in, out, inOut, scalar and local below. Buffer arguments describe
+// a host array backed by the device buffer at the same argument position, scalars are copied
+// into the argument, local arguments reserve __local memory of the given size
+
+struct KernelArg {
+    enum Kind : unsigned char { SCALAR, BUFFER, LOCAL, DEVICE };
+    Kind kind = SCALAR;
+    bool input = false;                 // buffer is uploaded before kernels run
+    bool output = false;                // buffer is downloaded after kernels run
+    void* data = nullptr;               // host array of a buffer argument
+    size_t element = 0;                 // size of one element
+    size_t bytes = 0;                   // size of the array, the scalar or the local memory
+    alignas(8) unsigned char value[8] = {};  // scalar value or cl_mem of a device buffer
+};
+
+template<class T> KernelArg bufferArg(const T* data, size_t count, bool input, bool output)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "Buffer elements must be trivially copyable");
+    KernelArg arg;
+    arg.kind = KernelArg::BUFFER;
+    arg.input = input;
+    arg.output = output;
+    arg.data = const_cast<T*>(data);
+    arg.element = sizeof(T);
+    arg.bytes = sizeof(T) * count;
+    return arg;
+}
+
+template<class T> KernelArg in(const T* data, size_t count) { return bufferArg(data, count, true, false); }
+template<class T> KernelArg in(const std::vector<T>& data) { return bufferArg(data.data(), data.size(), true, false); }
+template<class T, size_t N> KernelArg in(const T (&data)[N]) { return bufferArg(data, N, true, false); }
+template<class T> KernelArg out(T* data, size_t count) { return bufferArg(data, count, false, true); }
+template<class T> KernelArg out(std::vector<T>& data) { return bufferArg(data.data(), data.size(), false, true); }
+template<class T, size_t N> KernelArg out(T (&data)[N]) { return bufferArg(data, N, false, true); }
+template<class T> KernelArg inOut(T* data, size_t count) { return bufferArg(data, count, true, true); }
+template<class T> KernelArg inOut(std::vector<T>& data) { return bufferArg(data.data(), data.size(), true, true); }
+template<class T, size_t N> KernelArg inOut(T (&data)[N]) { return bufferArg(data, N, true, true); }
+
+template<class T> KernelArg scalar(T value)
+{
+    static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, "Scalar arguments must be numbers");
+    static_assert(sizeof(T) <= sizeof(KernelArg::value), "Scalar argument is too large");
+    KernelArg arg;
+    arg.element = arg.bytes = sizeof(T);
+    memcpy(arg.value, &value, sizeof(T));
+    return arg;
+}
+
+template<class T> KernelArg local(size_t count)
+{
+    KernelArg arg;
+    arg.kind = KernelArg::LOCAL;
+    arg.element = sizeof(T);
+    arg.bytes = sizeof(T) * count;
+    return arg;
+}
+
+// Global and optional local work size of up to 3 dimensions, stored without heap allocation,
+// e.g. {n}, {{x, y}, {lx, ly}} or {{x, y}, {}} to let the driver choose the local size
+
+struct NDRange {
+    cl_uint dims = 0;
+    size_t global[3] = {};
+    size_t local[3] = {};
+    bool hasLocal = false;
+    NDRange(size_t globalSize) : dims(1) { global[0] = globalSize; }
+    NDRange(std::initializer_list<size_t> globalSize, std::initializer_list<size_t> localSize);
+    NDRange(const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize);
 };
 
+struct ArgBindingStats {
+    size_t requested = 0;    // argument bindings requested by launches
+    size_t issued = 0;       // clSetKernelArg calls made, the rest matched the bound value
+    size_t launches = 0;     // clEnqueueNDRangeKernel calls
+};
+
+struct ProfileStats {
+    size_t count = 0;        // number of profiled commands
+    cl_ulong bytes = 0;      // bytes moved by transfer commands
+    cl_ulong total = 0;      // sum of execution times (start to end), ns
+    cl_ulong min = 0;        // shortest execution time, ns
+    cl_ulong max = 0;        // longest execution time, ns
+    cl_ulong queued = 0;     // sum of times from queued to submit, ns
+    cl_ulong submitted = 0;  // sum of times from submit to start, ns
+    double mean() const { return count ? (double)total / count : 0.0; }
+};
+
+// Job running the kernels of one program. Jobs created with a context share its device, queue and
+// device memory, the others create their own context
+
 class OpenCL {
 private:
-    cl_platform_id _platform = 0;
-    cl_device_id _device = 0;
-    cl_context _context = nullptr;
-    cl_command_queue _queue = nullptr;
-    cl_program _program = nullptr;
-    std::vector<cl_kernel> _kernels{};
-    std::vector<cl_mem> _buffers{};
-
-    char* loadKernelSource(const std::string& filename);
-    void checkError(cl_int err, const std::string& operation);
-    void init(const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames);
+    friend class TaskGraph;
+    friend class CommandSequence;
+    using Buffer = Context::Buffer;
+
+    std::shared_ptr<Context> _context{};
+    std::shared_ptr<Program> _program{};
+    std::vector<Kernel> _kernels{};
+    ArgBindingStats _bindingStats{};
+    std::vector<Buffer> _buffers{};
+    HostMemory _hostMemory = HostMemory::COPY;
+    bool _profiling = false;
+    std::vector<std::tuple<std::string, cl_event, size_t>> _pendingEvents{};
+    std::map<std::string, ProfileStats> _profile{};
+    std::vector<std::pair<JobFuture, std::vector<Buffer>>> _inflight{};
+
+    void init(const std::vector<std::string>& kernelNames);
     void release();
 
+    static KernelArg toKernelArg(const std::tuple<ArgTypes, void*, size_t>& arg);
+    static cl_mem_flags argMemFlags(const KernelArg& arg);
+    void mapCopy(const Buffer& buffer, void* value, size_t bytes, bool toDevice);
+    void createBuffer(const KernelArg& arg);
+    void transferBuffer(size_t index, const KernelArg& arg, bool toDevice);
+    void bindArg(int idKernel, cl_uint index, const KernelArg& arg);
+    void setKernelArg(int idKernel, cl_uint index, size_t size, const void* value, bool memory);
+    void enqueueKernel(int idKernel, const NDRange& range);
+    cl_event enqueueKernelOn(cl_command_queue queue, int idKernel, const NDRange& range, const std::vector<cl_event>& waitList);
+    NDRange tuneLocalSize(int idKernel, const NDRange& range);
+    void runStreamed(const std::vector<KernelArg>& args, size_t chunkSize);
+    void writeBytes(const DeviceBuffer& buffer, const void* data, size_t bytes, size_t offset);
+    void readBytes(const DeviceBuffer& buffer, void* data, size_t bytes, size_t offset);
+    JobFuture writeAsyncBytes(const DeviceBuffer& buffer, const void* data, size_t bytes, const Dependencies& after);
+    JobFuture readAsyncBytes(const DeviceBuffer& buffer, void* data, size_t bytes, const Dependencies& after);
+    JobFuture launchAsyncBound(int idKernel, const NDRange& range, const Dependencies& after);
+    JobFuture runAsyncArgs(const NDRange& range, const Dependencies& after, const std::vector<KernelArg>& args);
+    JobFuture asyncFuture(const std::string& name, cl_event event, size_t bytes = 0);
+    void recycleInflight(bool all);
+
+    static const KernelArg& toArg(const KernelArg& arg) { return arg; }
+    static KernelArg toArg(const DeviceBuffer& buffer);
+
+    cl_event* profileEvent(cl_event& event);
+    void trackEvent(const std::string& name, cl_event event, size_t bytes = 0);
+    void collectProfile();
+
 public:
-    OpenCL(const std::string& kernelSourceFile, const std::string& kernelName);
-    OpenCL(const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames);
+    OpenCL(const std::string& kernelSourceFile, const std::string& kernelName, bool profiling = false, const BuildOptions& buildOptions = {});
+    OpenCL(const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames, bool profiling = false, const BuildOptions& buildOptions = {});
+    OpenCL(std::shared_ptr<Context> context, const std::string& kernelSourceFile, const std::string& kernelName, const BuildOptions& buildOptions = {});
+    OpenCL(std::shared_ptr<Context> context, const std::string& kernelSourceFile, const std::vector<std::string>& kernelNames, const BuildOptions& buildOptions = {});
+    OpenCL(std::shared_ptr<Program> program, const std::vector<std::string>& kernelNames);
     ~OpenCL();
+    OpenCL(const OpenCL&) = delete;
+    OpenCL& operator=(const OpenCL&) = delete;
 
-    void run(std::vector<std::tuple<ArgTypes, void*, size_t>> args, const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize = {});
+    const std::shared_ptr<Context>& context() const { return _context; }
+    const std::shared_ptr<Program>& program() const { return _program; }
 
-    void createBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args);
-    void readBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args);
-    void writeBuffers(std::vector<std::tuple<ArgTypes, void*, size_t>> args);
+    void run(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args, const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize = {});
+    void runStreamed(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args, size_t chunkSize = 0);
+
+    void createBuffers(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args);
+    void readBuffers(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args);
+    void writeBuffers(const std::vector<std::tuple<ArgTypes, void*, size_t>>& args);
     void freeBuffers();
-    void runKernel(int idKkernel, std::vector<std::tuple<ArgTypes, void*, size_t>> args, const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize = {});
+    void finish();
+    bool programFromCache() const { return _program->fromCache(); }
+    double programBuildTime() const { return _program->buildTime(); }
+
+    void setHostMemory(HostMemory mode);
+    HostMemory hostMemory() const { return _hostMemory; }
+    static void* allocHostMemory(size_t bytes);
+    static void freeHostMemory(void* memory);
+
+    // Device buffers of the context, e.g. DeviceBuffer& m = job.buffer<float>("matrix", n); job.write(m, data, n);
+
+    template<class T> DeviceBuffer allocate(const std::string& name, size_t count) { return _context->allocate<T>(name, count); }
+    template<class T> DeviceBuffer& buffer(const std::string& name, size_t count) { return _context->buffer<T>(name, count); }
+    DeviceBuffer& buffer(const std::string& name) { return _context->buffer(name); }
+    bool hasBuffer(const std::string& name) const { return _context->hasBuffer(name); }
+    void eraseBuffer(const std::string& name) { _context->eraseBuffer(name); }
+    template<class T> void write(const DeviceBuffer& buffer, const T* data, size_t count, size_t offset = 0) { writeBytes(buffer, data, sizeof(T) * count, sizeof(T) * offset); }
+    template<class T> void read(const DeviceBuffer& buffer, T* data, size_t count, size_t offset = 0) { readBytes(buffer, data, sizeof(T) * count, sizeof(T) * offset); }
+    void copy(const DeviceBuffer& from, const DeviceBuffer& to);
+
+    void setBufferPoolLimit(size_t bytes) { _context->setBufferPoolLimit(bytes); }
+    void trimBufferPool() { _context->trimBufferPool(); }
+    const BufferPoolStats& bufferPoolStats() const { return _context->bufferPoolStats(); }
+
+    bool profiling() const { return _profiling; }
+    const std::map<std::string, ProfileStats>& profile();
+    void printProfile();
+    void resetProfile();
+
+    size_t kernelWorkGroupSize(int idKernel) const { return _kernels.at(idKernel).workGroupSize(); }
+    bool bound(int idKernel) const { return _kernels.at(idKernel).bound(); }
+    void setArg(int idKernel, cl_uint index, const KernelArg& arg) { bindArg(idKernel, index, arg); }
+    void unbind(int idKernel) { _kernels.at(idKernel).unbind(); }
+    const ArgBindingStats& argBindingStats() const { return _bindingStats; }
+    void runKernel(int idKkernel, const std::vector<std::tuple<ArgTypes, void*, size_t>>& args, const std::vector<size_t>& globalSize, const std::vector<size_t>& localSize = {});
+
+    // Typed argument API, e.g. job.launch(kernel, {n}, in(a, n), out(result, n), scalar(n), local<float>(64)),
+    // device buffers may be passed directly.
+    // Arguments equal to the last bound ones are not passed to the driver again, and a launch with
+    // fewer arguments keeps the rest bound, so a loop may pass only the changing leading ones or
+    // update one slot with setArg and launch with no arguments
+
+    template<class... Args> using KernelArgs = std::enable_if_t<((std::is_same<Args, KernelArg>::value || std::is_same<Args, DeviceBuffer>::value) && ...)>;
+
+    template<class... Args, class = KernelArgs<Args...>> void launch(int idKernel, const NDRange& range, const Args&... args)
+    {
+        cl_uint index = 0;
+        (bindArg(idKernel, index++, toArg(args)), ...);
+        enqueueKernel(idKernel, range);
+    }
+
+    // Local work size auto-tuning: binds the arguments, times the legal local sizes for the global
+    // range and returns the range with the fastest one, e.g. job.launch(k, job.tune(k, {n}, args...)).
+    // The choice is stored in the tuning database and reused by later runs without timing.
+    // Buffers the kernel may write are restored after tuning, so any kernel can be tuned on live data.
+    // A local size in the range is the largest one to try in each dimension, e.g. for __local arrays
+
+    template<class... Args, class = KernelArgs<Args...>> NDRange tune(int idKernel, const NDRange& range, const Args&... args)
+    {
+        cl_uint index = 0;
+        (bindArg(idKernel, index++, toArg(args)), ...);
+        return tuneLocalSize(idKernel, range);
+    }
+
+    // Asynchronous API: the calls enqueue their commands after the commands of the dependencies and
+    // return at once with a future of completion, so the host may prepare the next job meanwhile, e.g.
+    // JobFuture done = job.runAsync({n}, {}, in(a, n), out(result, n)); prepare(); done.wait();
+    // Host arrays must stay valid until the future is ready. runAsync uploads, runs all kernels and
+    // downloads like run, always through device buffers that return to the pool once it completed.
+    // hostEvent gives a future completed by the host with complete(), for commands that must wait
+    // for host-side work
+
+    template<class T> JobFuture writeAsync(const DeviceBuffer& buffer, const T* data, size_t count, const Dependencies& after = {}) { return writeAsyncBytes(buffer, data, sizeof(T) * count, after); }
+    template<class T> JobFuture readAsync(const DeviceBuffer& buffer, T* data, size_t count, const Dependencies& after = {}) { return readAsyncBytes(buffer, data, sizeof(T) * count, after); }
+    JobFuture hostEvent() const { return JobFuture::user(*_context); }
+
+    template<class... Args, class = KernelArgs<Args...>> JobFuture launchAsync(int idKernel, const NDRange& range, const Dependencies& after, const Args&... args)
+    {
+        cl_uint index = 0;
+        (bindArg(idKernel, index++, toArg(args)), ...);
+        return launchAsyncBound(idKernel, range, after);
+    }
+
+    template<class... Args, class = KernelArgs<Args...>> JobFuture runAsync(const NDRange& range, const Dependencies& after, const Args&... args)
+    {
+        return runAsyncArgs(range, after, { toArg(args)... });
+    }
+
+    template<class... Args, class = KernelArgs<Args...>> void createBuffers(const Args&... args)
+    {
+        freeBuffers();
+        try { (createBuffer(toArg(args)), ...); }
+        catch (...) { freeBuffers(); throw; }
+    }
+
+    template<class... Args, class = KernelArgs<Args...>> void writeBuffers(const Args&... args)
+    {
+        size_t index = 0;
+        (transferBuffer(index++, toArg(args), true), ...);
+    }
+
+    template<class... Args, class = KernelArgs<Args...>> void readBuffers(const Args&... args)
+    {
+        size_t index = 0;
+        (transferBuffer(index++, toArg(args), false), ...);
+    }
+
+    template<class... Args, class = KernelArgs<Args...>> void run(const NDRange& range, const Args&... args)
+    {
+        try {
+            createBuffers(args...);
+            for (int k = 0; k < (int)_kernels.size(); k++) launch(k, range, args...);
+            readBuffers(args...);
+            freeBuffers();
+        }
+        catch (...) {
+            freeBuffers();
+            throw;
+        }
+    }
 };
 
 #endif // OPENCL_H
@@ -0,0 +1,331 @@
+#include <limits.h>
+#include <algorithm>
+#include "primitives.h"
+
+/**************************************************************************************************
+ * Data-parallel primitives
+ *
+ * Kernels ship inside the library and are built on first use, one program per element type or
+ * key width. Temporary buffers (tile totals, positions, histograms, ping-pong copies of the keys)
+ * come from the context buffer pool, so repeated calls do not allocate device memory.
+ *
+ **************************************************************************************************/
+
+// Exclusive Blelloch scan of one value per work-item in local memory, the work-group size must be
+// a power of two. Returns the prefix of the calling work-item and stores the group total
+
+static const char* GROUP_SCAN_SOURCE = R"(
+#define GROUP_SCAN(NAME, TYPE)                                                              \
+TYPE NAME(TYPE v, __local TYPE* tmp, TYPE* total)                                           \
+{                                                                                           \
+    uint lid = get_local_id(0), size = get_local_size(0);                                   \
+    tmp[lid] = v;                                                                           \
+    barrier(CLK_LOCAL_MEM_FENCE);                                                           \
+    for (uint d = 1; d < size; d <<= 1) {                                                   \
+        uint i = (lid + 1) * d * 2 - 1;                                                     \
+        if (i < size) tmp[i] += tmp[i - d];                                                 \
+        barrier(CLK_LOCAL_MEM_FENCE);                                                       \
+    }                                                                                       \
+    *total = tmp[size - 1];                                                                 \
+    barrier(CLK_LOCAL_MEM_FENCE);                                                           \
+    if (lid == 0) tmp[size - 1] = 0;                                                        \
+    barrier(CLK_LOCAL_MEM_FENCE);                                                           \
+    for (uint d = size >> 1; d > 0; d >>= 1) {                                              \
+        uint i = (lid + 1) * d * 2 - 1;                                                     \
+        if (i < size) { TYPE t = tmp[i - d]; tmp[i - d] = tmp[i]; tmp[i] += t; }            \
+        barrier(CLK_LOCAL_MEM_FENCE);                                                       \
+    }                                                                                       \
+    return tmp[lid];                                                                        \
+}
+)";
+
+// Scan of T: a work-group scans a tile of ITEMS elements per work-item, staged in local memory so
+// that global reads and writes are coalesced, and stores the tile total to sums[group]
+
+static const char* SCAN_SOURCE = R"(
+#define ITEMS 4
+
+GROUP_SCAN(groupScan, T)
+
+__kernel void scanBlocks(__global const T* in, __global T* out, __global T* sums, const ulong n, const int inclusive,
+    __local T* tile, __local T* tmp)
+{
+    uint lid = get_local_id(0), size = get_local_size(0);
+    size_t base = get_group_id(0) * size * ITEMS;
+    for (uint k = 0; k < ITEMS; k++) {
+        size_t i = base + lid + k * size;
+        tile[lid + k * size] = i < n ? in[i] : 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    T sum = 0;
+    for (uint k = 0; k < ITEMS; k++) {
+        T x = tile[lid * ITEMS + k];
+        tile[lid * ITEMS + k] = inclusive ? sum + x : sum;
+        sum += x;
+    }
+    T total;
+    groupScan(sum, tmp, &total);
+
+    for (uint k = 0; k < ITEMS; k++) {
+        uint j = lid + k * size;
+        size_t i = base + j;
+        if (i < n) out[i] = tile[j] + tmp[j / ITEMS];
+    }
+    if (lid == 0) sums[get_group_id(0)] = total;
+}
+
+// Add the scanned tile totals to the tiles
+
+__kernel void addOffsets(__global T* out, __global const T* sums, const ulong n)
+{
+    uint lid = get_local_id(0), size = get_local_size(0);
+    size_t base = get_group_id(0) * size * ITEMS;
+    T offset = sums[get_group_id(0)];
+    for (uint k = 0; k < ITEMS; k++) {
+        size_t i = base + lid + k * size;
+        if (i < n) out[i] += offset;
+    }
+}
+)";
+
+// Compaction scatter of E elements to the exclusive scan positions of their flags, positions past
+// the capacity of out are not written
+
+static const char* COMPACT_SOURCE = R"(
+__kernel void compactScatter(__global const E* values, __global const uint* flags, __global const uint* positions,
+    const ulong n, __global E* out, const ulong capacity)
+{
+    size_t i = get_global_id(0);
+    if (i < n && flags[i] && positions[i] < capacity) out[positions[i]] = values[i];
+}
+)";
+
+// Radix sort pass over 4 bits of KEY starting at shift. radixCount stores the digit counts of each
+// tile digit-major, hist[digit * groups + group], so their exclusive scan gives the output offset
+// of every digit of every tile. radixScatter sorts its tile by the digit in local memory with four
+// stable one-bit splits and writes each digit run to its offset. Elements past n take digit 15
+// and stay behind the real ones, so the sort is stable
+
+static const char* RADIX_SOURCE = R"(
+#define RADIX_BITS 4
+#define RADIX 16
+
+GROUP_SCAN(groupScan, uint)
+
+__kernel void radixCount(__global const KEY* keys, const ulong n, const uint shift, __global uint* hist, __local uint* counts)
+{
+    uint lid = get_local_id(0);
+    if (lid < RADIX) counts[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    size_t i = get_global_id(0);
+    if (i < n) atomic_inc(&counts[(uint)(keys[i] >> shift) & (RADIX - 1)]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < RADIX) hist[lid * get_num_groups(0) + get_group_id(0)] = counts[lid];
+}
+
+__kernel void radixScatter(__global const KEY* keysIn, __global KEY* keysOut,
+#ifdef HAS_VALUES
+    __global const uint* valuesIn, __global uint* valuesOut,
+#endif
+    const ulong n, const uint shift, __global const uint* offsets,
+    __local KEY* localKeys, __local uint* localDigits,
+#ifdef HAS_VALUES
+    __local uint* localValues,
+#endif
+    __local uint* tmp, __local uint* starts)
+{
+    uint lid = get_local_id(0), size = get_local_size(0), group = get_group_id(0);
+    size_t i = get_global_id(0);
+    localKeys[lid] = i < n ? keysIn[i] : 0;
+    localDigits[lid] = i < n ? (uint)(keysIn[i] >> shift) & (RADIX - 1) : RADIX - 1;
+#ifdef HAS_VALUES
+    localValues[lid] = i < n ? valuesIn[i] : 0;
+#endif
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint b = 0; b < RADIX_BITS; b++) {
+        KEY key = localKeys[lid];
+        uint digit = localDigits[lid];
+#ifdef HAS_VALUES
+        uint value = localValues[lid];
+#endif
+        uint bit = (digit >> b) & 1, zeros;
+        uint rank = groupScan(1 - bit, tmp, &zeros);
+        uint dst = bit ? zeros + lid - rank : rank;
+        localKeys[dst] = key;
+        localDigits[dst] = digit;
+#ifdef HAS_VALUES
+        localValues[dst] = value;
+#endif
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    uint digit = localDigits[lid];
+    if (lid == 0 || localDigits[lid - 1] != digit) starts[digit] = lid;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    size_t valid = min((size_t)size, (size_t)(n - (size_t)group * size));
+    if (lid < valid) {
+        uint dst = offsets[digit * get_num_groups(0) + group] + lid - starts[digit];
+        keysOut[dst] = localKeys[lid];
+#ifdef HAS_VALUES
+        valuesOut[dst] = localValues[lid];
+#endif
+    }
+}
+)";
+
+enum ScanKernel { SCAN_BLOCKS, ADD_OFFSETS };
+enum RadixKernel { RADIX_COUNT, RADIX_SCATTER };
+
+static const size_t PRIMITIVES_LOCAL_SIZE = 256;   // work-group size limit of all kernels
+static const size_t SCAN_ITEMS = 4;                // elements per work-item of a scan tile, ITEMS in the kernel
+static const size_t RADIX_BITS = 4;                // key bits per radix sort pass
+static const size_t RADIX = 1 << RADIX_BITS;
+
+//~~~~~ Constructor and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+Primitives::Primitives(std::shared_ptr<Context> context)
+    : _context(std::move(context))
+{
+    if (!_context) throw OpenClError("Primitives need a context");
+}
+
+Primitives::~Primitives() = default;
+
+//~~~~~ Get job of kernel source and options, built on first use ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+OpenCL& Primitives::job(const char* source, const BuildOptions& options, const std::vector<std::string>& kernels)
+{
+    std::string key = kernels.front() + " " + options.str();
+    auto it = _jobs.find(key);
+    if (it != _jobs.end()) return *it->second;
+    auto program = Program::fromSource(_context, std::string(GROUP_SCAN_SOURCE) + source, options);
+    return *(_jobs[key] = std::unique_ptr<OpenCL>(new OpenCL(program, kernels)));
+}
+
+OpenCL& Primitives::scanJob(ScanType type)
+{
+    static const char* TYPE_NAMES[] = { "int", "uint", "float" };
+    return job(SCAN_SOURCE, BuildOptions().define("T", TYPE_NAMES[type]), { "scanBlocks", "addOffsets" });
+}
+
+//~~~~~ Copy between host data and device buffer ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void Primitives::writeBytes(const DeviceBuffer& buffer, const void* data, size_t bytes)
+{
+    if (!buffer || bytes > buffer.bytes()) throw OpenClError("Write outside of device buffer " + buffer.name());
+    cl_int err = clEnqueueWriteBuffer(_context->queue(), buffer.mem(), CL_TRUE, 0, bytes, data, 0, NULL, NULL);
+    checkError(err, "clEnqueueWriteBuffer");
+}
+
+void Primitives::readBytes(const DeviceBuffer& buffer, void* data, size_t bytes)
+{
+    if (!buffer || bytes > buffer.bytes()) throw OpenClError("Read outside of device buffer " + buffer.name());
+    cl_int err = clEnqueueReadBuffer(_context->queue(), buffer.mem(), CL_TRUE, 0, bytes, data, 0, NULL, NULL);
+    checkError(err, "clEnqueueReadBuffer");
+}
+
+//~~~~~ Power of two work-group size that all kernels allow ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t Primitives::groupSize(OpenCL& job, std::initializer_list<int> kernels) const
+{
+    size_t limit = PRIMITIVES_LOCAL_SIZE;
+    for (int kernel : kernels) limit = std::min(limit, job.kernelWorkGroupSize(kernel));
+    size_t size = 1;
+    while (size * 2 <= limit) size *= 2;
+    return size;
+}
+
+//~~~~~ Scan ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Every level divides the count by the tile size, so a billion elements need three levels
+
+void Primitives::scanBuffer(ScanType type, const DeviceBuffer& in, const DeviceBuffer& out, size_t count, bool inclusive)
+{
+    if (count * 4 > in.bytes() || count * 4 > out.bytes()) throw OpenClError("Scan is larger than the buffer");
+    if (count == 0) return;
+
+    OpenCL& j = scanJob(type);
+    size_t localSize = groupSize(j, { SCAN_BLOCKS, ADD_OFFSETS }), tile = localSize * SCAN_ITEMS;
+    size_t groups = (count + tile - 1) / tile;
+    cl_ulong n = count;
+
+    DeviceBuffer sums = j.allocate<cl_uint>("scan sums", groups);
+    j.launch(SCAN_BLOCKS, {{ groups * localSize }, { localSize }}, in, out, sums, scalar(n), scalar((cl_int)inclusive),
+        local<cl_uint>(tile), local<cl_uint>(localSize));
+    if (groups > 1)
+    {
+        scanBuffer(type, sums, sums, groups, false);
+        j.launch(ADD_OFFSETS, {{ groups * localSize }, { localSize }}, out, sums, scalar(n));
+    }
+}
+
+//~~~~~ Stream compaction ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t Primitives::compactBuffer(size_t element, const DeviceBuffer& values, const DeviceBuffer& flags, size_t count, const DeviceBuffer& out)
+{
+    if (count * element > values.bytes() || count * sizeof(cl_uint) > flags.bytes()) throw OpenClError("Compaction is larger than the buffer");
+    if (count > UINT_MAX) throw OpenClError("Compaction supports up to 2^32 - 1 elements");
+    if (count == 0) return 0;
+
+    DeviceBuffer positions = _context->allocate<cl_uint>("compact positions", count);
+    scanBuffer(UINT, flags, positions, count, false);
+
+    // The output size is known from the scan, so a too small out is rejected before any write to it
+    OpenCL& j = job(COMPACT_SOURCE, BuildOptions().define("E", element == 4 ? "uint" : "ulong"), { "compactScatter" });
+    cl_uint position = 0, flag = 0;
+    j.read(positions, &position, 1, count - 1);
+    j.read(flags, &flag, 1, count - 1);
+    size_t selected = (size_t)position + flag;
+    if (selected * element > out.bytes()) throw OpenClError("Compaction output buffer is too small");
+
+    size_t localSize = groupSize(j, { 0 });
+    cl_ulong n = count, capacity = out.bytes() / element;
+    j.launch(0, {{ (count + localSize - 1) / localSize * localSize }, { localSize }}, values, flags, positions, scalar(n), out, scalar(capacity));
+    return selected;
+}
+
+//~~~~~ LSD radix sort ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// The number of passes is even for both key widths, so the sorted data ends in the input buffers
+
+void Primitives::sortBuffer(bool wide, const DeviceBuffer& keys, const DeviceBuffer* values, size_t count)
+{
+    size_t keySize = wide ? sizeof(cl_ulong) : sizeof(cl_uint);
+    if (count * keySize > keys.bytes() || (values && count * sizeof(cl_uint) > values->bytes())) throw OpenClError("Sort is larger than the buffer");
+    if (count > UINT_MAX) throw OpenClError("Sort supports up to 2^32 - 1 elements");
+    if (count < 2) return;
+
+    BuildOptions options = BuildOptions().define("KEY", wide ? "ulong" : "uint");
+    if (values) options.define("HAS_VALUES");
+    OpenCL& j = job(RADIX_SOURCE, options, { "radixCount", "radixScatter" });
+    size_t localSize = std::max<size_t>(groupSize(j, { RADIX_COUNT, RADIX_SCATTER }), RADIX);
+    size_t groups = (count + localSize - 1) / localSize;
+    cl_ulong n = count;
+    NDRange range({ groups * localSize }, { localSize });
+
+    DeviceBuffer hist = j.allocate<cl_uint>("radix histogram", RADIX * groups);
+    DeviceBuffer tmpKeys = j.allocate<unsigned char>("radix keys", count * keySize);
+    DeviceBuffer tmpValues = values ? j.allocate<cl_uint>("radix values", count) : DeviceBuffer();
+    const DeviceBuffer* keysIn = &keys, * keysOut = &tmpKeys, * valuesIn = values, * valuesOut = &tmpValues;
+
+    for (cl_uint shift = 0; shift < keySize * 8; shift += RADIX_BITS)
+    {
+        j.launch(RADIX_COUNT, range, *keysIn, scalar(n), scalar(shift), hist, local<cl_uint>(RADIX));
+        scanBuffer(UINT, hist, hist, RADIX * groups, false);
+        if (values)
+        {
+            j.launch(RADIX_SCATTER, range, *keysIn, *keysOut, *valuesIn, *valuesOut, scalar(n), scalar(shift), hist,
+                local<unsigned char>(localSize * keySize), local<cl_uint>(localSize), local<cl_uint>(localSize), local<cl_uint>(localSize), local<cl_uint>(RADIX));
+            std::swap(valuesIn, valuesOut);
+        }
+        else
+        {
+            j.launch(RADIX_SCATTER, range, *keysIn, *keysOut, scalar(n), scalar(shift), hist,
+                local<unsigned char>(localSize * keySize), local<cl_uint>(localSize), local<cl_uint>(localSize), local<cl_uint>(RADIX));
+        }
+        std::swap(keysIn, keysOut);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <map>
+#include <memory>
+#include <type_traits>
+#include "opencl.h"
+
+// Data-parallel primitives on device buffers, e.g.
+// Primitives prims(context); prims.inclusiveScan<int>(in, out, n); prims.sort<cl_uint>(keys, n);
+// scan        - work-efficient Blelloch scan of int, unsigned int or float: each work-group scans
+//               a tile in local memory, tile totals are scanned recursively and added back
+// compact     - keeps the elements whose flag (cl_uint, 0 or 1) is set, in order, returns their count
+// sort        - stable LSD radix sort of cl_uint or cl_ulong keys, 4 bits per pass, sortPairs also
+//               moves cl_uint values with the keys
+// All calls are enqueued on the context queue; compact reads back only the count
+
+class Primitives {
+private:
+    enum ScanType { INT, UINT, FLOAT };
+
+    std::shared_ptr<Context> _context;
+    std::map<std::string, std::unique_ptr<OpenCL>> _jobs{};
+
+    template<class T> static constexpr ScanType scanTypeOf()
+    {
+        static_assert(std::is_same<T, int>::value || std::is_same<T, unsigned int>::value || std::is_same<T, float>::value,
+            "Scans support int, unsigned int and float");
+        return std::is_same<T, int>::value ? INT : std::is_same<T, float>::value ? FLOAT : UINT;
+    }
+
+    template<class K> static constexpr bool wideKey()
+    {
+        static_assert(std::is_integral<K>::value && std::is_unsigned<K>::value && (sizeof(K) == 4 || sizeof(K) == 8),
+            "Radix sort supports 32-bit and 64-bit unsigned keys");
+        return sizeof(K) == 8;
+    }
+
+    OpenCL& job(const char* source, const BuildOptions& options, const std::vector<std::string>& kernels);
+    OpenCL& scanJob(ScanType type);
+    size_t groupSize(OpenCL& job, std::initializer_list<int> kernels) const;
+    void scanBuffer(ScanType type, const DeviceBuffer& in, const DeviceBuffer& out, size_t count, bool inclusive);
+    size_t compactBuffer(size_t element, const DeviceBuffer& values, const DeviceBuffer& flags, size_t count, const DeviceBuffer& out);
+    void sortBuffer(bool wide, const DeviceBuffer& keys, const DeviceBuffer* values, size_t count);
+    void writeBytes(const DeviceBuffer& buffer, const void* data, size_t bytes);
+    void readBytes(const DeviceBuffer& buffer, void* data, size_t bytes);
+
+public:
+    explicit Primitives(std::shared_ptr<Context> context);
+    ~Primitives();
+    Primitives(const Primitives&) = delete;
+    Primitives& operator=(const Primitives&) = delete;
+
+    void finish() { _context->finish(); }
+
+    // Blocking copies between host arrays and device buffers, e.g. DeviceBuffer keys = context->allocate<cl_uint>("keys", n);
+
+    template<class T> void write(const DeviceBuffer& buffer, const T* data, size_t count) { writeBytes(buffer, data, sizeof(T) * count); }
+    template<class T> void read(const DeviceBuffer& buffer, T* data, size_t count) { readBytes(buffer, data, sizeof(T) * count); }
+
+    // in and out may be the same buffer
+
+    template<class T> void exclusiveScan(const DeviceBuffer& in, const DeviceBuffer& out, size_t count) { scanBuffer(scanTypeOf<T>(), in, out, count, false); }
+    template<class T> void inclusiveScan(const DeviceBuffer& in, const DeviceBuffer& out, size_t count) { scanBuffer(scanTypeOf<T>(), in, out, count, true); }
+
+    template<class T> size_t compact(const DeviceBuffer& values, const DeviceBuffer& flags, size_t count, const DeviceBuffer& out)
+    {
+        static_assert(sizeof(T) == 4 || sizeof(T) == 8, "Compaction supports 4-byte and 8-byte elements");
+        return compactBuffer(sizeof(T), values, flags, count, out);
+    }
+
+    template<class K> void sort(const DeviceBuffer& keys, size_t count) { sortBuffer(wideKey<K>(), keys, nullptr, count); }
+    template<class K> void sortPairs(const DeviceBuffer& keys, const DeviceBuffer& values, size_t count) { sortBuffer(wideKey<K>(), keys, &values, count); }
+};
+
+#endif // PRIMITIVES_H
@@ -0,0 +1,283 @@
+#include <string.h>
+#include <algorithm>
+#include "reduce.h"
+
+/**************************************************************************************************
+ * Parallel reductions
+ *
+ * One program per element type holds all reduction kernels. A reduction is two launches: the
+ * first pass of G work-groups leaves G partial results in a pooled device buffer, the finish
+ * pass of one work-group reduces them, and the host reads one value (and index for argmax).
+ *
+ **************************************************************************************************/
+
+static const char* REDUCE_SOURCE = R"(
+#ifdef USE_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+#ifdef USE_SUBGROUPS
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+// T - element type, S - type of sums, T_MAX and T_LOWEST - identities of min and max, ABS - absolute value
+
+#define ADD(x, y) ((x) + (y))
+
+// Work-group reduction of one value per work-item, every work-item gets the result. With sub-groups
+// each sub-group reduces its values first and the local memory tree runs over one value per sub-group
+
+#ifdef USE_SUBGROUPS
+#define GROUP_FIRST(SUB_GROUP_REDUCE)                                                       \
+    v = SUB_GROUP_REDUCE(v);                                                                \
+    if (get_sub_group_local_id() == 0) scratch[get_sub_group_id()] = v;                     \
+    uint count = get_num_sub_groups();
+#else
+#define GROUP_FIRST(SUB_GROUP_REDUCE)                                                       \
+    scratch[lid] = v;                                                                       \
+    uint count = get_local_size(0);
+#endif
+
+#define GROUP_REDUCE(NAME, TYPE, COMBINE, SUB_GROUP_REDUCE)                                 \
+TYPE NAME(TYPE v, __local TYPE* scratch)                                                    \
+{                                                                                           \
+    uint lid = get_local_id(0);                                                             \
+    GROUP_FIRST(SUB_GROUP_REDUCE)                                                           \
+    barrier(CLK_LOCAL_MEM_FENCE);                                                           \
+    uint half = 1;                                                                          \
+    while (half * 2 < count) half *= 2;                                                     \
+    for (uint s = half; s > 0; s >>= 1) {                                                   \
+        if (lid < s && lid + s < count) scratch[lid] = COMBINE(scratch[lid], scratch[lid + s]); \
+        barrier(CLK_LOCAL_MEM_FENCE);                                                       \
+    }                                                                                       \
+    return scratch[0];                                                                      \
+}
+
+GROUP_REDUCE(groupSum, S, ADD, sub_group_reduce_add)
+GROUP_REDUCE(groupMin, T, min, sub_group_reduce_min)
+GROUP_REDUCE(groupMax, T, max, sub_group_reduce_max)
+
+// Argmax pairs: the larger value wins, equal values keep the lower index, index n marks no value
+
+#define ARGMAX_BETTER(v2, i2, v1, i1) ((i2) != n && ((i1) == n || (v2) > (v1) || ((v2) == (v1) && (i2) < (i1))))
+
+void groupArgmax(T* v, ulong* index, ulong n, __local T* scratch, __local ulong* scratchIndex)
+{
+    uint lid = get_local_id(0), count = get_local_size(0);
+    scratch[lid] = *v;
+    scratchIndex[lid] = *index;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint half = 1;
+    while (half * 2 < count) half *= 2;
+    for (uint s = half; s > 0; s >>= 1) {
+        if (lid < s && lid + s < count && ARGMAX_BETTER(scratch[lid + s], scratchIndex[lid + s], scratch[lid], scratchIndex[lid])) {
+            scratch[lid] = scratch[lid + s];
+            scratchIndex[lid] = scratchIndex[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    *v = scratch[0];
+    *index = scratchIndex[0];
+}
+
+// First pass: each work-group reduces a grid-strided part of the input to partial[group]
+
+__kernel void reduceSum(__global const T* a, const ulong n, __global S* partial, __local S* scratch)
+{
+    S v = 0;
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) v += (S)a[i];
+    v = groupSum(v, scratch);
+    if (get_local_id(0) == 0) partial[get_group_id(0)] = v;
+}
+
+__kernel void reduceDot(__global const T* a, __global const T* b, const ulong n, __global S* partial, __local S* scratch)
+{
+    S v = 0;
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) v += (S)a[i] * (S)b[i];
+    v = groupSum(v, scratch);
+    if (get_local_id(0) == 0) partial[get_group_id(0)] = v;
+}
+
+__kernel void reduceMin(__global const T* a, const ulong n, __global T* partial, __local T* scratch)
+{
+    T v = T_MAX;
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) v = min(v, a[i]);
+    v = groupMin(v, scratch);
+    if (get_local_id(0) == 0) partial[get_group_id(0)] = v;
+}
+
+__kernel void reduceMax(__global const T* a, const ulong n, __global T* partial, __local T* scratch)
+{
+    T v = T_LOWEST;
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) v = max(v, a[i]);
+    v = groupMax(v, scratch);
+    if (get_local_id(0) == 0) partial[get_group_id(0)] = v;
+}
+
+__kernel void reduceMaxAbs(__global const T* a, const ulong n, __global T* partial, __local T* scratch)
+{
+    T v = 0;
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) v = max(v, (T)ABS(a[i]));
+    v = groupMax(v, scratch);
+    if (get_local_id(0) == 0) partial[get_group_id(0)] = v;
+}
+
+__kernel void reduceArgmax(__global const T* a, const ulong n, __global T* partial, __global ulong* partialIndex,
+    __local T* scratch, __local ulong* scratchIndex)
+{
+    T v = T_LOWEST;
+    ulong index = n;
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) {
+        if (index == n || a[i] > v) { v = a[i]; index = i; }
+    }
+    groupArgmax(&v, &index, n, scratch, scratchIndex);
+    if (get_local_id(0) == 0) { partial[get_group_id(0)] = v; partialIndex[get_group_id(0)] = index; }
+}
+
+// Second pass: one work-group reduces the partial results of the first pass to result[0]
+
+__kernel void finishSum(__global const S* partial, const ulong groups, __global S* result, __local S* scratch)
+{
+    S v = 0;
+    for (size_t i = get_local_id(0); i < groups; i += get_local_size(0)) v += partial[i];
+    v = groupSum(v, scratch);
+    if (get_local_id(0) == 0) result[0] = v;
+}
+
+__kernel void finishMin(__global const T* partial, const ulong groups, __global T* result, __local T* scratch)
+{
+    T v = T_MAX;
+    for (size_t i = get_local_id(0); i < groups; i += get_local_size(0)) v = min(v, partial[i]);
+    v = groupMin(v, scratch);
+    if (get_local_id(0) == 0) result[0] = v;
+}
+
+__kernel void finishMax(__global const T* partial, const ulong groups, __global T* result, __local T* scratch)
+{
+    T v = T_LOWEST;
+    for (size_t i = get_local_id(0); i < groups; i += get_local_size(0)) v = max(v, partial[i]);
+    v = groupMax(v, scratch);
+    if (get_local_id(0) == 0) result[0] = v;
+}
+
+__kernel void finishArgmax(__global const T* partial, __global const ulong* partialIndex, const ulong groups, const ulong n,
+    __global T* result, __global ulong* resultIndex, __local T* scratch, __local ulong* scratchIndex)
+{
+    T v = T_LOWEST;
+    ulong index = n;
+    for (size_t i = get_local_id(0); i < groups; i += get_local_size(0)) {
+        if (ARGMAX_BETTER(partial[i], partialIndex[i], v, index)) { v = partial[i]; index = partialIndex[i]; }
+    }
+    groupArgmax(&v, &index, n, scratch, scratchIndex);
+    if (get_local_id(0) == 0) { result[0] = v; resultIndex[0] = index; }
+}
+)";
+
+// Kernel order of the reduction jobs, finish kernels follow the first pass ones
+
+enum ReduceKernel { REDUCE_SUM, REDUCE_DOT, REDUCE_MIN, REDUCE_MAX, REDUCE_MAX_ABS, REDUCE_ARGMAX, FINISH_SUM, FINISH_MIN, FINISH_MAX, FINISH_ARGMAX };
+
+static const std::vector<std::string> REDUCE_KERNELS = {
+    "reduceSum", "reduceDot", "reduceMin", "reduceMax", "reduceMaxAbs", "reduceArgmax",
+    "finishSum", "finishMin", "finishMax", "finishArgmax"
+};
+
+static const size_t REDUCE_LOCAL_SIZE = 256;    // work-group size limit of both passes
+static const size_t REDUCE_GROUPS_PER_CU = 8;   // first pass work-groups per compute unit
+
+//~~~~~ Constructor and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+Reducer::Reducer(std::shared_ptr<Context> context)
+    : _context(std::move(context))
+{
+    if (!_context) throw OpenClError("Reducer needs a context");
+    _subgroups = _context->deviceInfo().hasExtension("cl_khr_subgroups");
+}
+
+Reducer::~Reducer() = default;
+
+//~~~~~ Get reduction job of element type, the program is built on first use ~~~~~~~~~~~~~~~~~~~~~~
+
+OpenCL& Reducer::job(Type type)
+{
+    if (_jobs[type]) return *_jobs[type];
+
+    const DeviceInfo& device = _context->deviceInfo();
+    BuildOptions options;
+    switch (type)
+    {
+        case INT:
+            options.define("T", "int").define("S", "long").define("T_MAX", "INT_MAX").define("T_LOWEST", "INT_MIN").define("ABS", "abs");
+            break;
+        case FLOAT:
+            options.define("T", "float").define("S", "float").define("T_MAX", "INFINITY").define("T_LOWEST", "-INFINITY").define("ABS", "fabs");
+            break;
+        default:
+            if (!device.hasExtension("cl_khr_fp64")) throw OpenClError("Device " + device.name + " has no double precision support");
+            options.define("T", "double").define("S", "double").define("T_MAX", "INFINITY").define("T_LOWEST", "-INFINITY").define("ABS", "fabs").define("USE_FP64");
+    }
+    if (_subgroups) options.define("USE_SUBGROUPS");
+
+    _jobs[type].reset(new OpenCL(Program::fromSource(_context, REDUCE_SOURCE, options), REDUCE_KERNELS));
+    return *_jobs[type];
+}
+
+//~~~~~ Reduce buffer with operation ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// value receives a ReduceSum<T> for SUM and DOT and a T otherwise, index the position for ARGMAX
+
+void Reducer::reduce(Type type, ReduceOp op, const DeviceBuffer& a, const DeviceBuffer* b, size_t count, void* value, size_t* index)
+{
+    static const size_t ELEMENT_SIZE[TYPES] = { sizeof(int), sizeof(float), sizeof(double) };
+    static const size_t SUM_SIZE[TYPES] = { sizeof(long long), sizeof(float), sizeof(double) };
+
+    bool summing = op == ReduceOp::SUM || op == ReduceOp::DOT;
+    size_t valueSize = summing ? SUM_SIZE[type] : ELEMENT_SIZE[type];
+    if (count * ELEMENT_SIZE[type] > a.bytes() || (b && count * ELEMENT_SIZE[type] > b->bytes())) throw OpenClError("Reduction is larger than the buffer");
+    if (count == 0)
+    {
+        if (op == ReduceOp::MIN || op == ReduceOp::MAX || op == ReduceOp::ARGMAX) throw OpenClError("Reduction of an empty buffer");
+        memset(value, 0, valueSize);
+        return;
+    }
+
+    int pass, finish;
+    switch (op)
+    {
+        case ReduceOp::SUM:     pass = REDUCE_SUM;     finish = FINISH_SUM;    break;
+        case ReduceOp::DOT:     pass = REDUCE_DOT;     finish = FINISH_SUM;    break;
+        case ReduceOp::MIN:     pass = REDUCE_MIN;     finish = FINISH_MIN;    break;
+        case ReduceOp::MAX:     pass = REDUCE_MAX;     finish = FINISH_MAX;    break;
+        case ReduceOp::MAX_ABS: pass = REDUCE_MAX_ABS; finish = FINISH_MAX;    break;
+        default:                pass = REDUCE_ARGMAX;  finish = FINISH_ARGMAX;
+    }
+
+    // Power of two work-group size that both kernels allow, and enough groups to fill the device
+
+    OpenCL& j = job(type);
+    size_t limit = std::min({ REDUCE_LOCAL_SIZE, j.kernelWorkGroupSize(pass), j.kernelWorkGroupSize(finish) });
+    size_t localSize = 1;
+    while (localSize * 2 <= limit) localSize *= 2;
+    size_t groups = std::min((count + localSize - 1) / localSize, std::max<size_t>(_context->deviceInfo().computeUnits, 1) * REDUCE_GROUPS_PER_CU);
+
+    DeviceBuffer partial = j.allocate<unsigned char>("reduce partial", groups * valueSize);
+    DeviceBuffer result = j.allocate<unsigned char>("reduce result", valueSize);
+    cl_ulong n = count, partials = groups;
+
+    if (op == ReduceOp::ARGMAX)
+    {
+        DeviceBuffer partialIndex = j.allocate<cl_ulong>("reduce partial index", groups);
+        DeviceBuffer resultIndex = j.allocate<cl_ulong>("reduce result index", 1);
+        j.launch(pass, {{ groups * localSize }, { localSize }}, a, scalar(n), partial, partialIndex, local<cl_ulong>(localSize), local<cl_ulong>(localSize));
+        j.launch(finish, {{ localSize }, { localSize }}, partial, partialIndex, scalar(partials), scalar(n), result, resultIndex, local<cl_ulong>(localSize), local<cl_ulong>(localSize));
+        cl_ulong position = 0;
+        j.read(resultIndex, &position, 1);
+        *index = (size_t)position;
+    }
+    else
+    {
+        if (op == ReduceOp::DOT) j.launch(pass, {{ groups * localSize }, { localSize }}, a, *b, scalar(n), partial, local<cl_ulong>(localSize));
+        else j.launch(pass, {{ groups * localSize }, { localSize }}, a, scalar(n), partial, local<cl_ulong>(localSize));
+        j.launch(finish, {{ localSize }, { localSize }}, partial, scalar(partials), result, local<cl_ulong>(localSize));
+    }
+    j.read(result, (unsigned char*)value, valueSize);
+}
@@ -0,0 +1,96 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <memory>
+#include <type_traits>
+#include "opencl.h"
+
+enum class ReduceOp { SUM, DOT, MIN, MAX, MAX_ABS, ARGMAX };
+
+// Type of sums and dot products: 64-bit for int, so that sums of large buffers do not overflow
+
+template<class T> using ReduceSum = std::conditional_t<std::is_integral<T>::value, long long, T>;
+
+// Result of argmax: the largest value and the lowest index that holds it
+
+template<class T> struct ArgMax {
+    T value{};
+    size_t index = 0;
+};
+
+// Reductions of device buffers of int, float or double to one value, e.g.
+// Reducer reduce(context); float err = reduce.maxAbs<float>(residuals, n);
+// The first pass reduces grid-strided parts of the buffer per work-group in local memory (after
+// sub-group reductions when the device has cl_khr_subgroups), the second pass reduces the
+// partial results in one work-group, and only the final value is read back to the host
+
+class Reducer {
+private:
+    enum Type { INT, FLOAT, DOUBLE, TYPES };
+
+    std::shared_ptr<Context> _context;
+    std::unique_ptr<OpenCL> _jobs[TYPES];
+    bool _subgroups = false;
+
+    template<class T> static constexpr Type typeOf()
+    {
+        static_assert(std::is_same<T, int>::value || std::is_same<T, float>::value || std::is_same<T, double>::value,
+            "Reductions support int, float and double");
+        return std::is_same<T, int>::value ? INT : std::is_same<T, float>::value ? FLOAT : DOUBLE;
+    }
+
+    OpenCL& job(Type type);
+    void reduce(Type type, ReduceOp op, const DeviceBuffer& a, const DeviceBuffer* b, size_t count, void* value, size_t* index);
+
+public:
+    explicit Reducer(std::shared_ptr<Context> context);
+    ~Reducer();
+    Reducer(const Reducer&) = delete;
+    Reducer& operator=(const Reducer&) = delete;
+
+    bool subgroups() const { return _subgroups; }
+
+    template<class T> ReduceSum<T> sum(const DeviceBuffer& data, size_t count)
+    {
+        ReduceSum<T> value{};
+        reduce(typeOf<T>(), ReduceOp::SUM, data, nullptr, count, &value, nullptr);
+        return value;
+    }
+
+    template<class T> ReduceSum<T> dot(const DeviceBuffer& a, const DeviceBuffer& b, size_t count)
+    {
+        ReduceSum<T> value{};
+        reduce(typeOf<T>(), ReduceOp::DOT, a, &b, count, &value, nullptr);
+        return value;
+    }
+
+    template<class T> T min(const DeviceBuffer& data, size_t count)
+    {
+        T value{};
+        reduce(typeOf<T>(), ReduceOp::MIN, data, nullptr, count, &value, nullptr);
+        return value;
+    }
+
+    template<class T> T max(const DeviceBuffer& data, size_t count)
+    {
+        T value{};
+        reduce(typeOf<T>(), ReduceOp::MAX, data, nullptr, count, &value, nullptr);
+        return value;
+    }
+
+    template<class T> T maxAbs(const DeviceBuffer& data, size_t count)
+    {
+        T value{};
+        reduce(typeOf<T>(), ReduceOp::MAX_ABS, data, nullptr, count, &value, nullptr);
+        return value;
+    }
+
+    template<class T> ArgMax<T> argmax(const DeviceBuffer& data, size_t count)
+    {
+        ArgMax<T> result;
+        reduce(typeOf<T>(), ReduceOp::ARGMAX, data, nullptr, count, &result.value, &result.index);
+        return result;
+    }
+};
+
+#endif // REDUCE_H
@@ -0,0 +1,200 @@
+#include <string.h>
+#include <mutex>
+#if __has_include(<CL/cl_ext.h>)
+#include <CL/cl_ext.h>
+#endif
+#include "sequence.h"
+
+/**************************************************************************************************
+ * Recorded command sequences
+ *
+ * Replays go through the binding cache of the job, so the first step of every kernel, which holds
+ * all of its recorded arguments, restores the kernel state even when the kernel was launched with
+ * other arguments between replays. The command buffer path is compiled when the OpenCL headers
+ * declare cl_khr_command_buffer and used when the device reports it; each command waits for the
+ * previous one through its sync point, so the steps keep their order. Any failure to build the
+ * command buffer leaves the sequence on the launch path.
+ *
+ **************************************************************************************************/
+
+#ifdef cl_khr_command_buffer
+
+// Entry points of the extension, looked up once per platform
+
+struct CommandBufferApi {
+    decltype(&clCreateCommandBufferKHR) create = nullptr;
+    decltype(&clCommandNDRangeKernelKHR) ndrange = nullptr;
+    decltype(&clFinalizeCommandBufferKHR) finalize = nullptr;
+    decltype(&clEnqueueCommandBufferKHR) enqueue = nullptr;
+    decltype(&clReleaseCommandBufferKHR) release = nullptr;
+    bool valid() const { return create && ndrange && finalize && enqueue && release; }
+};
+
+static const CommandBufferApi& commandBufferApi(cl_platform_id platform)
+{
+    static std::mutex mutex;
+    static std::map<cl_platform_id, CommandBufferApi> apis;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = apis.find(platform);
+    if (it != apis.end()) return it->second;
+    CommandBufferApi& api = apis[platform];
+    api.create = (decltype(api.create))clGetExtensionFunctionAddressForPlatform(platform, "clCreateCommandBufferKHR");
+    api.ndrange = (decltype(api.ndrange))clGetExtensionFunctionAddressForPlatform(platform, "clCommandNDRangeKernelKHR");
+    api.finalize = (decltype(api.finalize))clGetExtensionFunctionAddressForPlatform(platform, "clFinalizeCommandBufferKHR");
+    api.enqueue = (decltype(api.enqueue))clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueCommandBufferKHR");
+    api.release = (decltype(api.release))clGetExtensionFunctionAddressForPlatform(platform, "clReleaseCommandBufferKHR");
+    return api;
+}
+
+#endif
+
+//~~~~~ Constructor and destructor ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+CommandSequence::CommandSequence(OpenCL& job, size_t flushInterval)
+    : _job(job), _flushInterval(flushInterval ? flushInterval : 1)
+{
+}
+
+CommandSequence::~CommandSequence()
+{
+    releaseCommandBuffer();
+}
+
+//~~~~~ Record step ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool CommandSequence::sameArg(const KernelArg& a, const KernelArg& b)
+{
+    return a.kind == b.kind && a.bytes == b.bytes && (a.kind == KernelArg::LOCAL || memcmp(a.value, b.value, a.bytes) == 0);
+}
+
+void CommandSequence::recordArgs(int idKernel, const NDRange& range, std::vector<KernelArg>&& args)
+{
+    if (_finalized) throw OpenClError("Command sequence is finalized, clear() it to record again");
+    if (idKernel < 0 || idKernel >= (int)_job._kernels.size()) throw OpenClError("Unknown kernel " + std::to_string(idKernel) + " in command sequence");
+
+    Step step;
+    step.kernel = idKernel;
+    step.range = range;
+    std::vector<KernelArg>& recorded = _recorded[idKernel];
+    for (cl_uint index = 0; index < args.size(); index++)
+    {
+        if (args[index].kind == KernelArg::BUFFER) throw OpenClError("Command sequences take device buffers, not host arrays");
+        if (index < recorded.size() && sameArg(recorded[index], args[index])) continue;
+        step.args.emplace_back(index, args[index]);
+        if (index >= recorded.size()) recorded.resize(index + 1);
+        recorded[index] = args[index];
+    }
+    _steps.push_back(std::move(step));
+}
+
+void CommandSequence::bindStep(const Step& step)
+{
+    for (const auto& arg : step.args) _job.bindArg(step.kernel, arg.first, arg.second);
+}
+
+//~~~~~ End recording ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void CommandSequence::finalize(bool useCommandBuffer)
+{
+    if (_finalized) return;
+    _finalized = true;
+    if (useCommandBuffer && _job.context()->deviceInfo().hasExtension("cl_khr_command_buffer")) buildCommandBuffer();
+}
+
+bool CommandSequence::buildCommandBuffer()
+{
+#ifdef cl_khr_command_buffer
+    const CommandBufferApi& api = commandBufferApi(_job.context()->platform());
+    if (!api.valid() || _steps.empty()) return false;
+
+    cl_int err;
+    cl_command_queue queue = _job.context()->queue();
+    _commandBuffer = api.create(1, &queue, NULL, &err);
+    if (err != CL_SUCCESS) { _commandBuffer = nullptr; return false; }
+
+    cl_sync_point_khr previous = 0;
+    for (size_t i = 0; i < _steps.size(); i++)
+    {
+        const Step& step = _steps[i];
+        const Kernel& kernel = _job._kernels[step.kernel];
+        bindStep(step);
+        if (!kernel.bound()) { releaseCommandBuffer(); throw OpenClError("Kernel " + kernel.name() + " has unbound arguments"); }
+        cl_sync_point_khr point = 0;
+        err = api.ndrange(_commandBuffer, NULL, NULL, kernel.kernel(), step.range.dims, NULL, step.range.global, step.range.hasLocal ? step.range.local : NULL,
+            i ? 1 : 0, i ? &previous : NULL, &point, NULL);
+        if (err != CL_SUCCESS) { releaseCommandBuffer(); return false; }
+        previous = point;
+    }
+    if (api.finalize(_commandBuffer) != CL_SUCCESS) { releaseCommandBuffer(); return false; }
+    return true;
+#else
+    return false;
+#endif
+}
+
+//~~~~~ Replay ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void CommandSequence::replay()
+{
+    if (!_finalized) finalize();
+    Timer timer;
+    cl_command_queue queue = _job.context()->queue();
+
+#ifdef cl_khr_command_buffer
+    if (_commandBuffer)
+    {
+        const CommandBufferApi& api = commandBufferApi(_job.context()->platform());
+        checkError(api.enqueue(1, &queue, _commandBuffer, 0, NULL, NULL), "clEnqueueCommandBufferKHR");
+        checkError(clFlush(queue), "clFlush");
+        _stats.flushes++;
+    }
+    else
+#endif
+    {
+        size_t pending = 0;
+        for (const Step& step : _steps)
+        {
+            bindStep(step);
+            _job.enqueueKernel(step.kernel, step.range);
+            _stats.argUpdates += step.args.size();
+            if (++pending == _flushInterval)
+            {
+                checkError(clFlush(queue), "clFlush");
+                _stats.flushes++;
+                pending = 0;
+            }
+        }
+        if (pending)
+        {
+            checkError(clFlush(queue), "clFlush");
+            _stats.flushes++;
+        }
+    }
+
+    _stats.replays++;
+    _stats.launches += _steps.size();
+    _stats.lastUs = timer.ns() * 1e-3;
+    _stats.totalUs += _stats.lastUs;
+}
+
+//~~~~~ Remove steps ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void CommandSequence::clear()
+{
+    releaseCommandBuffer();
+    _steps.clear();
+    _recorded.clear();
+    _finalized = false;
+}
+
+void CommandSequence::releaseCommandBuffer()
+{
+#ifdef cl_khr_command_buffer
+    if (_commandBuffer)
+    {
+        const CommandBufferApi& api = commandBufferApi(_job.context()->platform());
+        api.release(_commandBuffer);
+    }
+#endif
+    _commandBuffer = nullptr;
+}
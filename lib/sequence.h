@@ -0,0 +1,75 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <map>
+#include <utility>
+#include <vector>
+#include "opencl.h"
+
+struct _cl_command_buffer_khr;
+
+struct SequenceStats {
+    size_t replays = 0;         // replay() calls
+    size_t launches = 0;        // kernel launches enqueued by replays
+    size_t argUpdates = 0;      // arguments set by replays, the others were kept bound
+    size_t flushes = 0;         // clFlush calls of replays
+    double lastUs = 0;          // host time of the last replay, us
+    double totalUs = 0;         // host time of all replays, us
+    double meanUs() const { return replays ? totalUs / replays : 0.0; }
+};
+
+// Fixed sequence of kernel launches of one job, recorded once and replayed with little host work,
+// e.g. for (col...) seq.record(K, range, matrix, scalar(col)); seq.finalize(); seq.replay();
+// Each step keeps only the arguments that differ from the previous step of the same kernel, so
+// a replay sets just those (typically one scalar) and enqueues with the stored NDRange, flushing
+// the queue every flushInterval launches. When the device has cl_khr_command_buffer, finalize()
+// records the steps into a command buffer and a replay is one enqueue call. Device buffers
+// passed to record() must stay allocated while the sequence is replayed
+
+class CommandSequence {
+private:
+    struct Step {
+        int kernel = 0;
+        NDRange range{ 0 };
+        std::vector<std::pair<cl_uint, KernelArg>> args{};
+    };
+
+    OpenCL& _job;
+    size_t _flushInterval;
+    std::vector<Step> _steps{};
+    std::map<int, std::vector<KernelArg>> _recorded{};   // last recorded arguments of each kernel
+    _cl_command_buffer_khr* _commandBuffer = nullptr;
+    bool _finalized = false;
+    SequenceStats _stats{};
+
+    static bool sameArg(const KernelArg& a, const KernelArg& b);
+    void recordArgs(int idKernel, const NDRange& range, std::vector<KernelArg>&& args);
+    void bindStep(const Step& step);
+    bool buildCommandBuffer();
+    void releaseCommandBuffer();
+
+public:
+    explicit CommandSequence(OpenCL& job, size_t flushInterval = 64);
+    ~CommandSequence();
+    CommandSequence(const CommandSequence&) = delete;
+    CommandSequence& operator=(const CommandSequence&) = delete;
+
+    template<class... Args, class = OpenCL::KernelArgs<Args...>> void record(int idKernel, const NDRange& range, const Args&... args)
+    {
+        recordArgs(idKernel, range, { OpenCL::toArg(args)... });
+    }
+
+    // Ends recording, useCommandBuffer = false keeps replays on the launch path even when the
+    // device supports command buffers
+
+    void finalize(bool useCommandBuffer = true);
+    void replay();
+    void clear();
+
+    size_t size() const { return _steps.size(); }
+    bool finalized() const { return _finalized; }
+    bool commandBuffer() const { return _commandBuffer != nullptr; }
+    const SequenceStats& stats() const { return _stats; }
+};
+
+#endif // SEQUENCE_H
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "timer.h"
+
+//~~~~~ Get current time in milliseconds ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t getTime()
+{
+    return getTimeNs() / 1'000'000;
+}
+
+//~~~~~ Get current time in nanoseconds ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t getTimeNs()
+{
+    return (size_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**************************************************************************************************
+ * Timing span report
+ *
+ * Spans form a tree rooted at an unnamed node. Each node keeps the number of times it was
+ * entered and the total time spent in it. The tree is shared by all threads and guarded by
+ * a mutex; each thread tracks its own innermost open span.
+ *
+ **************************************************************************************************/
+
+struct TimeSpanNode {
+    std::string name;
+    size_t count = 0;
+    size_t totalNs = 0;
+    std::vector<std::unique_ptr<TimeSpanNode>> children;
+};
+
+static TimeSpanNode spanRoot;
+static std::mutex spanMutex;
+static thread_local TimeSpanNode* spanCurrent = nullptr;
+
+//~~~~~ Open span as a child of the current one ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+TimeSpan::TimeSpan(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(spanMutex);
+    _parent = spanCurrent ? spanCurrent : &spanRoot;
+    _node = nullptr;
+    for (auto& child : _parent->children) if (child->name == name) { _node = child.get(); break; }
+    if (!_node)
+    {
+        _parent->children.emplace_back(new TimeSpanNode());
+        _node = _parent->children.back().get();
+        _node->name = name;
+    }
+    spanCurrent = _node;
+    _timer.restart();
+}
+
+TimeSpan::~TimeSpan()
+{
+    stop();
+}
+
+//~~~~~ Close span and return its duration in nanoseconds ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+size_t TimeSpan::stop()
+{
+    size_t ns = _timer.ns();
+    if (!_running) return ns;
+    _running = false;
+
+    std::lock_guard<std::mutex> lock(spanMutex);
+    _node->count++;
+    _node->totalNs += ns;
+    if (spanCurrent == _node) spanCurrent = _parent == &spanRoot ? nullptr : _parent;
+    return ns;
+}
+
+//~~~~~ Print span tree ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static void printSpan(const TimeSpanNode& node, size_t parentNs, int depth)
+{
+    std::string label = std::string(depth * 2, ' ') + node.name;
+    printf("%-40s %8zu %12.3f", label.c_str(), node.count, node.totalNs * 1e-6);
+    if (parentNs) printf(" %7.1f%%\n", 100.0 * node.totalNs / parentNs);
+    else printf(" %8s\n", "");
+    for (const auto& child : node.children) printSpan(*child, node.totalNs, depth + 1);
+}
+
+void printTimeReport()
+{
+    std::lock_guard<std::mutex> lock(spanMutex);
+    printf("\n~~~~~ Timing report\n");
+    printf("%-40s %8s %12s %8s\n", "span", "count", "total ms", "parent");
+    for (const auto& child : spanRoot.children) printSpan(*child, 0, 0);
+}
+
+//~~~~~ Clear span tree ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Must not be called while spans are open.
+
+void resetTimeReport()
+{
+    std::lock_guard<std::mutex> lock(spanMutex);
+    spanRoot.children.clear();
+}
@@ -0,0 +1,54 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+#include <string>
+
+size_t getTime();
+size_t getTimeNs();
+
+//~~~~~ Monotonic stopwatch with nanosecond resolution ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+class Timer {
+private:
+    std::chrono::steady_clock::time_point _start;
+
+public:
+    Timer() : _start(std::chrono::steady_clock::now()) {}
+
+    void restart() { _start = std::chrono::steady_clock::now(); }
+    size_t ns() const {
+        return (size_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+    }
+    double ms() const { return ns() * 1e-6; }
+};
+
+//~~~~~ Scoped timing span ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// A span measures the time from its construction until stop() or destruction and adds it to
+// a global report. Spans opened while another span is open on the same thread become its
+// children; spans with the same name under the same parent are accumulated.
+
+struct TimeSpanNode;
+
+class TimeSpan {
+private:
+    TimeSpanNode* _node;
+    TimeSpanNode* _parent;
+    Timer _timer;
+    bool _running = true;
+
+public:
+    explicit TimeSpan(const std::string& name);
+    ~TimeSpan();
+    TimeSpan(const TimeSpan&) = delete;
+    TimeSpan& operator=(const TimeSpan&) = delete;
+
+    size_t stop();
+    double ms() const { return _timer.ms(); }
+};
+
+void printTimeReport();
+void resetTimeReport();
+
+#endif // TIMER_H
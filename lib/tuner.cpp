@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "tuner.h"
+
+/**************************************************************************************************
+ * Local work size tuning database
+ *
+ * One line per entry: the key, a tab, then dims, three local sizes and the kernel time in ms.
+ * The whole file is rewritten through a temporary file on every store, so concurrent runs never
+ * see a partly written database; the last writer wins.
+ *
+ **************************************************************************************************/
+
+//~~~~~ Constructor and process-wide database ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+TuningDB::TuningDB(const std::string& path)
+    : _path(path)
+{
+    load();
+}
+
+TuningDB& TuningDB::global()
+{
+    static TuningDB db([] {
+        const char* env = getenv("OPENCL_TUNING_DB");
+        if (env) return std::string(env);
+        const char* cacheEnv = getenv("OPENCL_CACHE_DIR");
+        std::string dir = cacheEnv ? cacheEnv : "./clcache";
+        return dir.empty() ? dir : dir + "/tuning.txt";
+    }());
+    return db;
+}
+
+//~~~~~ Load database from file ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Malformed lines are skipped, so a damaged file only loses its damaged entries
+
+void TuningDB::load()
+{
+    if (_path.empty()) return;
+    FILE* file = fopen(_path.c_str(), "r");
+    if (!file) return;
+
+    char line[2048];
+    while (fgets(line, sizeof(line), file))
+    {
+        char* tab = strrchr(line, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+        TuningResult result;
+        if (sscanf(tab + 1, "%u %zu %zu %zu %lf", &result.dims, &result.local[0], &result.local[1], &result.local[2], &result.ms) != 5) continue;
+        if (result.dims < 1 || result.dims > 3) continue;
+        _entries[line] = result;
+    }
+    fclose(file);
+}
+
+//~~~~~ Save database to file ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void TuningDB::save()
+{
+    if (_path.empty()) return;
+    size_t slash = _path.rfind('/');
+    if (slash != std::string::npos && slash > 0) mkdir(_path.substr(0, slash).c_str(), 0755);
+
+    std::string tmpPath = _path + "." + std::to_string(getpid()) + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "w");
+    if (!file) return;
+    bool written = true;
+    for (const auto& entry : _entries)
+    {
+        const TuningResult& r = entry.second;
+        written = fprintf(file, "%s\t%u %zu %zu %zu %.6f\n", entry.first.c_str(), r.dims, r.local[0], r.local[1], r.local[2], r.ms) > 0 && written;
+    }
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tmpPath.c_str(), _path.c_str()) != 0) remove(tmpPath.c_str());
+}
+
+//~~~~~ Find, store and erase entries ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+bool TuningDB::find(const std::string& key, TuningResult& result) const
+{
+    auto it = _entries.find(key);
+    if (it == _entries.end()) return false;
+    result = it->second;
+    return true;
+}
+
+void TuningDB::store(const std::string& key, const TuningResult& result)
+{
+    _entries[key] = result;
+    save();
+}
+
+void TuningDB::erase(const std::string& key)
+{
+    if (_entries.erase(key)) save();
+}
+
+/**************************************************************************************************
+ * Local work size candidates
+ *
+ **************************************************************************************************/
+
+std::vector<std::array<size_t, 3>> localSizeCandidates(cl_uint dims, const size_t* global, size_t maxWorkGroupSize,
+    size_t preferredMultiple, const std::vector<size_t>& maxWorkItemSizes)
+{
+    // Sizes of each dimension that divide its global size
+    std::vector<size_t> sizes[3];
+    for (cl_uint d = 0; d < 3; d++)
+    {
+        if (d >= dims) { sizes[d] = { 1 }; continue; }
+        size_t limit = std::min(global[d], maxWorkGroupSize);
+        if (d < maxWorkItemSizes.size() && maxWorkItemSizes[d]) limit = std::min(limit, maxWorkItemSizes[d]);
+        for (size_t s = 1; s <= limit; s *= 2) if (global[d] % s == 0) sizes[d].push_back(s);
+        if (preferredMultiple > 1 && preferredMultiple <= limit && global[d] % preferredMultiple == 0
+            && std::find(sizes[d].begin(), sizes[d].end(), preferredMultiple) == sizes[d].end()) sizes[d].push_back(preferredMultiple);
+    }
+
+    std::vector<std::array<size_t, 3>> all, aligned;
+    for (size_t x : sizes[0])
+        for (size_t y : sizes[1])
+            for (size_t z : sizes[2])
+            {
+                size_t total = x * y * z;
+                if (total > maxWorkGroupSize) continue;
+                all.push_back({ x, y, z });
+                if (preferredMultiple <= 1 || total % preferredMultiple == 0) aligned.push_back({ x, y, z });
+            }
+    return aligned.empty() ? all : aligned;
+}
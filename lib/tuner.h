@@ -0,0 +1,48 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <CL/cl.h>
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+
+// Best local work size found for a kernel and global range
+
+struct TuningResult {
+    cl_uint dims = 0;
+    size_t local[3] = {};
+    double ms = 0;           // kernel time with this local size
+};
+
+// Tuning results keyed by device, kernel and problem shape, kept in a text file so that later runs
+// reuse them. The file is OPENCL_TUNING_DB, or tuning.txt in the binary cache directory
+// (OPENCL_CACHE_DIR, ./clcache by default); results stay in memory only when the path is empty
+
+class TuningDB {
+private:
+    std::string _path{};
+    std::map<std::string, TuningResult> _entries{};
+
+    void load();
+    void save();
+
+public:
+    explicit TuningDB(const std::string& path);
+    static TuningDB& global();
+
+    bool find(const std::string& key, TuningResult& result) const;
+    void store(const std::string& key, const TuningResult& result);
+    void erase(const std::string& key);
+    const std::string& path() const { return _path; }
+    size_t size() const { return _entries.size(); }
+};
+
+// Legal local sizes for a global range: every dimension divides the global size and fits the device
+// item limit, the total fits the kernel work-group limit and is a multiple of the preferred
+// multiple when the range allows it. Sizes are powers of two plus the preferred multiple itself
+
+std::vector<std::array<size_t, 3>> localSizeCandidates(cl_uint dims, const size_t* global, size_t maxWorkGroupSize,
+    size_t preferredMultiple, const std::vector<size_t>& maxWorkItemSizes);
+
+#endif // TUNER_H
@@ -1,7 +1,29 @@
-// OpenCL kernel for multiplying two integer matrix
+// OpenCL kernels for multiplying two integer matrix
 
 // #pragma OPENCL EXTENSION cl_khr_fp64 : enable
 
+// Tile sizes are selected at build time: -DTILE=<n> -DWPT=<m>, TILE must be a multiple of WPT.
+// With -DDIM=<dimension> the matrix size is a compile-time constant instead of the dim argument,
+// so the compiler folds the index math and the tile loop count
+
+#ifdef DIM
+#define N DIM
+#else
+#define N dim
+#endif
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+#ifndef WPT
+#define WPT 4
+#endif
+
+#define RTILE (TILE / WPT)
+
+// One work-item per product term, accumulated with atomics (result must be zeroed before launch)
+
 __kernel void mul(
     __global const int *a, 
     __global const int *b,
@@ -12,8 +34,57 @@ __kernel void mul(
     int c = get_global_id(1);
     int k = get_global_id(2);
     // printf("%d %d %d\n", r, c, k);
-    if (r < dim && c < dim && k < dim) {
-        int v =  a[r * dim + k] * b[k * dim + c];
-        atomic_add(&result[r * dim + c], v);
+    if (r < N && c < N && k < N) {
+        int v =  a[r * N + k] * b[k * N + c];
+        atomic_add(&result[r * N + c], v);
+    }
+}
+
+// Tiled multiplication: a work-group computes a TILE x TILE block of the result, staging
+// tiles of a and b in local memory; each work-item accumulates WPT rows of one column in
+// registers and writes every output once.
+// Only the first rows rows of a and result are computed, so a part of the rows of a larger matrix
+// is multiplied with a and result holding just that part (rows = dim for the whole matrix).
+// Global size: { ceil(dim / TILE) * TILE, ceil(rows / TILE) * RTILE }, local size: { TILE, RTILE }
+
+__kernel void mulTiled(
+    __global const int *a, 
+    __global const int *b,
+    __global int *result, 
+    const int dim,
+    const int rows
+) {
+    __local int ta[TILE][TILE];
+    __local int tb[TILE][TILE];
+
+    int lc = get_local_id(0);
+    int lr = get_local_id(1);
+    int c = get_group_id(0) * TILE + lc;
+    int r0 = get_group_id(1) * TILE;
+
+    int acc[WPT];
+    for (int w = 0; w < WPT; w++) acc[w] = 0;
+
+    for (int t = 0; t < N; t += TILE) {
+        for (int w = 0; w < WPT; w++) {
+            int lrw = lr + w * RTILE;
+            int ar = r0 + lrw, ac = t + lc;
+            int br = t + lrw;
+            ta[lrw][lc] = (ar < rows && ac < N) ? a[ar * N + ac] : 0;
+            tb[lrw][lc] = (br < N && c < N) ? b[br * N + c] : 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int k = 0; k < TILE; k++) {
+            int bk = tb[k][lc];
+            for (int w = 0; w < WPT; w++) acc[w] += ta[lr + w * RTILE][k] * bk;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int w = 0; w < WPT; w++) {
+        int r = r0 + lr + w * RTILE;
+        if (r < rows && c < N) result[r * N + c] = acc[w];
     }
-}
\ No newline at end of file
+}
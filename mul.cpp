@@ -1,10 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <thread>
 #include "opencl.h"
+#include "cpugemm.h"
 
 const char* CL_KERNEL_SOURCE = "mul.cl";
-const char* CL_KERNEL_NAME = "mul";
+const char* CL_KERNEL_ATOMIC = "mul";       // one work-item per product, atomic accumulation
+const char* CL_KERNEL_TILED  = "mulTiled";  // local memory tiles, one write per output
+
+const size_t TILE = 16;        // tile size of the tiled kernel
+const size_t WPT  = 4;         // result rows per work-item of the tiled kernel
 
 const size_t DIM  = 2500;      // 2D square matrix dimension
 const size_t SIZE = DIM * DIM; // 1D array size for square matrix
@@ -24,13 +32,71 @@ void printMatrix(int* matrix)
     }
 }
 
-int main()
+// Multiply matrices a and b with the given kernel of the shared program, returns kernel run time in ms
+
+double mulOpenCL(const std::shared_ptr<Program>& program, const char* kernelName, int* a, int* b, int* result)
+{
+    TimeSpan span(kernelName);
+    TimeSpan spanInit("init");
+    OpenCL job(program, { kernelName });
+    spanInit.stop();
+
+    TimeSpan spanRun("run");
+    if (strcmp(kernelName, CL_KERNEL_ATOMIC) == 0)
+    {
+        memset(result, 0, SIZE * sizeof(int)); // atomic kernel accumulates into the result
+        job.run(
+            {
+                {ArgTypes::IN_IBUF,     (void*)a,      SIZE },
+                {ArgTypes::IN_IBUF,     (void*)b,      SIZE },
+                {ArgTypes::IN_OUT_IBUF, (void*)result, SIZE },
+                {ArgTypes::INT,         (void*)&DIM,   1    }
+            },
+            { DIM, DIM, DIM }
+        );
+    }
+    else
+    {
+        size_t groups = (DIM + TILE - 1) / TILE;
+        job.run(
+            {
+                {ArgTypes::IN_IBUF,  (void*)a,      SIZE },
+                {ArgTypes::IN_IBUF,  (void*)b,      SIZE },
+                {ArgTypes::OUT_IBUF, (void*)result, SIZE },
+                {ArgTypes::INT,      (void*)&DIM,   1    },
+                {ArgTypes::INT,      (void*)&DIM,   1    }
+            },
+            { groups * TILE, groups * (TILE / WPT) },
+            { TILE, TILE / WPT }
+        );
+    }
+    return spanRun.stop() * 1e-6;
+}
+
+// Start the tiled kernel without waiting, the returned future completes after the readback and
+// stores the device time in ms measured from the call
+
+JobFuture mulOpenCLAsync(OpenCL& job, int* a, int* b, int* result, double& ms)
+{
+    size_t groups = (DIM + TILE - 1) / TILE;
+    Timer timer;
+    JobFuture done = job.runAsync({{ groups * TILE, groups * (TILE / WPT) }, { TILE, TILE / WPT }}, {},
+        in(a, SIZE), in(b, SIZE), out(result, SIZE), scalar((int)DIM), scalar((int)DIM));
+    done.then([timer, &ms](cl_int) { ms = timer.ms(); });
+    return done;
+}
+
+// Usage: mul [tiled|atomic|both|overlap], "both" runs both kernels and compares their results,
+// "overlap" runs the tiled kernel asynchronously while the CPU computes the reference product
+
+int main(int argc, char** argv)
 {
     try { 
 
-        srand(time(NULL));
+        std::string mode = argc > 1 ? argv[1] : "tiled";
+        if (mode != "tiled" && mode != "atomic" && mode != "both" && mode != "overlap") throw std::runtime_error("unknown mode " + mode);
 
-        size_t tsStart, tsEnd;
+        srand(time(NULL));
 
         // Input data
 
@@ -43,36 +109,58 @@ int main()
 
         printf("\n~~~~~ Let's go with OpenCL\n");
 
-        OpenCL job(CL_KERNEL_SOURCE, CL_KERNEL_NAME);
-
-        tsStart = getTime();
-        job.run(
-            {
-                {ArgTypes::IN_IBUF,  (void*)a,      SIZE },
-                {ArgTypes::IN_IBUF,  (void*)b,      SIZE },
-                {ArgTypes::OUT_IBUF, (void*)result, SIZE },
-                {ArgTypes::INT,      (void*)&DIM,   1    }
-            },
-            { DIM, DIM, DIM }
-        );
-        tsEnd = getTime();
-        size_t tsWopenCL = tsEnd - tsStart;
+        TimeSpan spanOpenCL("with OpenCL");
+        TimeSpan spanInit("init");
+        auto context = Context::create();       // one context and program variant for both kernels
+        ProgramCache programs(context);
+        BuildOptions options = BuildOptions().define("TILE", TILE).define("WPT", WPT).define("DIM", DIM);
+        auto program = programs.get(CL_KERNEL_SOURCE, options);
+        spanInit.stop();
+        printf("Device %s (%s)\n", context->deviceInfo().name.c_str(), context->deviceInfo().typeName().c_str());
+        printf("Program %s in %.3f ms\n", program->fromCache() ? "loaded from binary cache" : "compiled from source", program->buildTime());
+
+        double tsWopenCL = 0, tsAtomic = 0;
+        bool isKernelEqual = true;
+        std::unique_ptr<OpenCL> asyncJob;
+        JobFuture asyncDone;
+        Timer overlapTimer;
+        if (mode == "overlap")
+        {
+            asyncJob.reset(new OpenCL(program, { CL_KERNEL_TILED }));
+            overlapTimer.restart();
+            asyncDone = mulOpenCLAsync(*asyncJob, a, b, result, tsWopenCL);
+        }
+        else if (mode == "atomic") tsWopenCL = mulOpenCL(program, CL_KERNEL_ATOMIC, a, b, result);
+        else tsWopenCL = mulOpenCL(program, CL_KERNEL_TILED, a, b, result);
+        if (mode == "both")
+        {
+            int *atomicResult = new int[SIZE];
+            tsAtomic = mulOpenCL(programs.get(CL_KERNEL_SOURCE, options), CL_KERNEL_ATOMIC, a, b, atomicResult);
+            isKernelEqual = memcmp(result, atomicResult, SIZE * sizeof(int)) == 0;
+            delete[] atomicResult;
+        }
+        spanOpenCL.stop();
 
-        printMatrix(result);
+        if (mode != "overlap") printMatrix(result);
 
         printf("\n~~~~~ Let's go without OpenCL\n");
 
-        int refResult[SIZE]{};
-
-        tsStart = getTime();
-        for (size_t r = 0; r < DIM; r++)
-            for (size_t c = 0; c < DIM; c++)
-                for (size_t k = 0; k < DIM; k++)
-                    refResult[ID(r,c)] += a[ID(r,k)] * b[ID(k,c)];
+        int *refResult = (int*)aligned_alloc(64, (SIZE * sizeof(int) + 63) / 64 * 64);
+        if (!refResult) throw std::runtime_error("failed to allocate reference result");
 
-        tsEnd = getTime();
-        size_t tsWOopenCL = tsEnd - tsStart;
+        TimeSpan spanCPU("without OpenCL");
+        cpuGemm(a, b, refResult, DIM);
+        double tsWOopenCL = spanCPU.stop() * 1e-6;
 
+        double tsOverlap = 0;
+        if (mode == "overlap")
+        {
+            asyncDone.wait();
+            tsOverlap = overlapTimer.ms();
+            printf("\n~~~~~ OpenCL result, computed meanwhile\n");
+            printMatrix(result);
+            printf("\n");
+        }
         printMatrix(refResult);
 
         bool isEqual = true;
@@ -88,14 +176,24 @@ int main()
         delete[] a;
         delete[] b;
         delete[] result;
+        free(refResult);
 
         printf("\n~~~~~ Results comparison\n");
         if (isEqual) printf("   OpenCL and CPU result are the same\n");
         else printf("   OpenCL and CPU results differ!\n");
+        if (mode == "both")
+        {
+            if (isKernelEqual) printf("   tiled and atomic kernel results are bit-exact\n");
+            else printf("   tiled and atomic kernel results differ!\n");
+        }
 
         printf("\n~~~~~ Execution time\n");
-        printf("     with OpenCL: %zu ms\n", tsWopenCL);
-        printf("  without OpenCL: %zu ms\n", tsWOopenCL);
+        double ops = 2.0 * DIM * DIM * DIM; // multiply-add count of the product
+        printf("     with OpenCL: %.3f ms, %.2f GFLOP/s (%s kernel)\n", tsWopenCL, ops / tsWopenCL * 1e-6, mode == "atomic" ? CL_KERNEL_ATOMIC : CL_KERNEL_TILED);
+        if (mode == "both") printf("   atomic kernel: %.3f ms, %.2f GFLOP/s (tiled speedup %.1fx)\n", tsAtomic, ops / tsAtomic * 1e-6, tsAtomic / tsWopenCL);
+        printf("  without OpenCL: %.3f ms, %.2f GFLOP/s (blocked CPU, %u threads)\n", tsWOopenCL, ops / tsWOopenCL * 1e-6, std::max(1u, std::thread::hardware_concurrency()));
+        if (mode == "overlap") printf("      overlapped: %.3f ms for both, %.3f ms one after the other\n", tsOverlap, tsWopenCL + tsWOopenCL);
+        printTimeReport();
         printf("\n~~~~~ Bye!\n");
     }
     catch (const OpenClError& e)
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include "opencl.h"
+#include "multidevice.h"
+#include "cpugemm.h"
+
+const size_t SUM_SIZE = 50'000'000;  // elements of the sum arrays
+const size_t DIM      = 1500;        // dimension of the square matrices of mul
+const size_t TILE     = 16;          // tile size of the tiled mul kernel
+const size_t WPT      = 4;           // result rows per work-item of the tiled mul kernel
+const int RUNS        = 5;           // runs of each kernel, the shares adapt between them
+
+// Adds the arrays split into one chunk per device
+
+bool runSum(MultiDevice& devices)
+{
+    std::vector<int> a(SUM_SIZE), b(SUM_SIZE), result(SUM_SIZE);
+    for (size_t i = 0; i < SUM_SIZE; i++)
+    {
+        a[i] = rand() % 1000;
+        b[i] = rand() % 1000;
+    }
+
+    devices.build("sum.cl");
+    int kernel = devices.kernel("sum");
+    bool correct = true;
+    printf("\n~~~~~ sum of %zu elements\n", SUM_SIZE);
+    for (int run = 1; run <= RUNS && correct; run++)
+    {
+        std::fill(result.begin(), result.end(), 0);
+        Timer timer;
+        devices.run(kernel, SUM_SIZE, [](size_t items) { return NDRange(items); },
+            split(in(a)), split(in(b)), split(out(result)), partSize());
+        printf("run %d: %.3f ms\n", run, timer.ms());
+        devices.printShares();
+        for (size_t i = 0; i < SUM_SIZE && correct; i++) correct = result[i] == a[i] + b[i];
+    }
+    printf("%s\n", correct ? "result is correct" : "WRONG RESULT");
+    return correct;
+}
+
+// Multiplies the matrices split into row blocks, every device reads the whole of b
+
+bool runMul(MultiDevice& devices)
+{
+    std::vector<int> a(DIM * DIM), b(DIM * DIM), result(DIM * DIM), reference(DIM * DIM);
+    for (size_t i = 0; i < DIM * DIM; i++)
+    {
+        a[i] = rand() % 201 - 100;
+        b[i] = rand() % 201 - 100;
+    }
+    cpuGemm(a.data(), b.data(), reference.data(), DIM);
+
+    devices.build("mul.cl", BuildOptions().define("TILE", TILE).define("WPT", WPT));
+    int kernel = devices.kernel("mulTiled");
+    auto rowRange = [](size_t rows) {
+        return NDRange({ (DIM + TILE - 1) / TILE * TILE, (rows + TILE - 1) / TILE * (TILE / WPT) }, { TILE, TILE / WPT });
+    };
+
+    bool correct = true;
+    printf("\n~~~~~ mul of %zu x %zu matrices\n", DIM, DIM);
+    for (int run = 1; run <= RUNS && correct; run++)
+    {
+        std::fill(result.begin(), result.end(), 0);
+        Timer timer;
+        devices.run(kernel, DIM, rowRange, split(in(a)), in(b), split(out(result)), scalar((int)DIM), partSize());
+        printf("run %d: %.3f ms\n", run, timer.ms());
+        devices.printShares();
+        correct = result == reference;
+    }
+    printf("%s\n", correct ? "result is correct" : "WRONG RESULT");
+    return correct;
+}
+
+// Usage: multidevice [devices], devices as in OPENCL_DEVICES: "all" (default), "split:N" for N
+// sub-devices of one device, or a comma-separated list of device specs, e.g. "0:0,0:1" for the
+// first two devices of platform 0 (the P:D indexes shown by the devices example)
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        srand(time(NULL));
+        MultiDevice devices(argc > 1 ? argv[1] : "");
+        printf("%zu devices:\n", devices.devices());
+        for (const auto& share : devices.shares()) printf("  %-40s first share %5.1f%%\n", share.name.c_str(), share.share * 100);
+
+        bool correct = runSum(devices);
+        correct = runMul(devices) && correct;
+        printf("\n~~~~~ Bye!\n");
+        return correct ? 0 : 1;
+    }
+    catch (const OpenClError& e)
+    {
+        printf("OpenCL error: %s\n", e.what());
+        return 1;
+    }
+    catch (const std::exception& e)
+    {
+        printf("Error: %s\n", e.what());
+        return 1;
+    }
+}
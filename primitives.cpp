@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include "opencl.h"
+#include "primitives.h"
+
+const int RUNS = 5;   // timed runs of every primitive, the best one is reported
+
+// Best time in ms of RUNS calls of f, preceded by a warm-up call that also builds the kernels
+
+template<class F> double best(F f)
+{
+    f();
+    double ms = 1e30;
+    for (int run = 0; run < RUNS; run++)
+    {
+        Timer timer;
+        f();
+        ms = std::min(ms, timer.ms());
+    }
+    return ms;
+}
+
+void report(const char* name, size_t n, double gpu, double cpu, bool ok)
+{
+    printf("%-22s GPU %9.3f ms %9.1f Mkeys/s   CPU %9.3f ms %9.1f Mkeys/s   %s\n",
+        name, gpu, n / gpu * 1e-3, cpu, n / cpu * 1e-3, ok ? "ok" : "WRONG");
+}
+
+// Usage: primitives [n], times device scan, compaction and radix sort of n keys (default 16M)
+// against the parallel std::inclusive_scan, std::copy_if and std::sort, timings exclude transfers
+
+int main(int argc, char** argv)
+{
+    size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 16 * 1024 * 1024;
+    if (n == 0) { printf("Usage: primitives [n]\n"); return 1; }
+
+    try {
+        auto context = Context::create();
+        const DeviceInfo& device = context->deviceInfo();
+        printf("Device %s (%s)\n", device.name.c_str(), device.typeName().c_str());
+        printf("Keys %zu\n\n", n);
+
+        Primitives prims(context);
+        std::mt19937_64 random(2024);
+        std::vector<cl_uint> keys(n), result(n), expected(n), flags(n);
+        for (size_t i = 0; i < n; i++) { keys[i] = (cl_uint)random(); flags[i] = keys[i] & 1; }
+
+        DeviceBuffer in = context->allocate<cl_uint>("keys", n);
+        DeviceBuffer out = context->allocate<cl_uint>("result", n);
+        DeviceBuffer flagBuffer = context->allocate<cl_uint>("flags", n);
+        prims.write(flagBuffer, flags.data(), n);
+
+        // Inclusive scan, sums wrap modulo 2^32 on both sides
+
+        prims.write(in, keys.data(), n);
+        double gpu = best([&] { prims.inclusiveScan<cl_uint>(in, out, n); prims.finish(); });
+        double cpu = best([&] { std::inclusive_scan(std::execution::par, keys.begin(), keys.end(), expected.begin()); });
+        prims.read(out, result.data(), n);
+        report("inclusive scan", n, gpu, cpu, result == expected);
+
+        // Compaction of the odd keys
+
+        size_t count = 0, expectedCount = 0;
+        gpu = best([&] { count = prims.compact<cl_uint>(in, flagBuffer, n, out); });
+        cpu = best([&] {
+            expectedCount = std::copy_if(std::execution::par, keys.begin(), keys.end(), expected.begin(), [](cl_uint k) { return k & 1; }) - expected.begin();
+        });
+        prims.read(out, result.data(), count);
+        report("compact", n, gpu, cpu, count == expectedCount && std::equal(result.begin(), result.begin() + count, expected.begin()));
+
+        // 32-bit keys, every run sorts a fresh copy of the unsorted keys
+
+        gpu = best([&] { prims.write(in, keys.data(), n); prims.finish(); });
+        double sortGpu = best([&] { prims.write(in, keys.data(), n); prims.sort<cl_uint>(in, n); prims.finish(); }) - gpu;
+        double sortCpu = best([&] { expected = keys; std::sort(std::execution::par, expected.begin(), expected.end()); }) - best([&] { expected = keys; });
+        std::sort(expected.begin(), expected.end());
+        prims.read(in, result.data(), n);
+        report("sort 32-bit", n, sortGpu, sortCpu, result == expected);
+
+        // 64-bit keys with their original positions as payload
+
+        std::vector<cl_ulong> wideKeys(n), wideResult(n), wideExpected(n);
+        std::vector<cl_uint> index(n), payload(n);
+        for (size_t i = 0; i < n; i++) wideKeys[i] = random();
+        std::iota(index.begin(), index.end(), 0);
+        DeviceBuffer wideIn = context->allocate<cl_ulong>("wide keys", n);
+
+        gpu = best([&] { prims.write(wideIn, wideKeys.data(), n); prims.write(out, index.data(), n); prims.finish(); });
+        sortGpu = best([&] { prims.write(wideIn, wideKeys.data(), n); prims.write(out, index.data(), n); prims.sortPairs<cl_ulong>(wideIn, out, n); prims.finish(); }) - gpu;
+        sortCpu = best([&] { wideExpected = wideKeys; std::sort(std::execution::par, wideExpected.begin(), wideExpected.end()); }) - best([&] { wideExpected = wideKeys; });
+        prims.read(wideIn, wideResult.data(), n);
+        prims.read(out, payload.data(), n);
+        bool ok = wideResult == wideExpected;
+        for (size_t i = 0; ok && i < n; i++) ok = payload[i] < n && wideKeys[payload[i]] == wideResult[i];
+        report("sort pairs 64-bit", n, sortGpu, sortCpu, ok);
+    }
+    catch (const OpenClError& e) {
+        printf("Error: %s\n", e.what());
+        return 1;
+    }
+
+    printf("\n~~~~~ Bye!\n");
+    return 0;
+}
@@ -10,4 +10,30 @@ __kernel void sum(
     if (idx < size) {
         result[idx] = a[idx] + b[idx]; // Add elements
     }
-}
\ No newline at end of file
+}
+
+// Vectorised variants: each work-item adds vectors of N ints loaded with vloadN, striding over the
+// arrays by the global size, so any number of work-items covers the whole range. The last
+// size % N elements are added one by one. Kernels: sumVec2, sumVec4, sumVec8, sumVec16
+
+#define SUM_VEC(N)                                                                  \
+__kernel void sumVec##N(                                                            \
+    __global const int *a,                                                          \
+    __global const int *b,                                                          \
+    __global int *result,                                                           \
+    const int size                                                                  \
+) {                                                                                 \
+    size_t vectors = (size_t)size / N;                                              \
+    size_t stride = get_global_size(0);                                             \
+    for (size_t v = get_global_id(0); v < vectors; v += stride) {                   \
+        vstore##N(vload##N(v, a) + vload##N(v, b), v, result);                      \
+    }                                                                               \
+    for (size_t i = vectors * N + get_global_id(0); i < (size_t)size; i += stride) { \
+        result[i] = a[i] + b[i];                                                    \
+    }                                                                               \
+}
+
+SUM_VEC(2)
+SUM_VEC(4)
+SUM_VEC(8)
+SUM_VEC(16)
@@ -1,64 +1,178 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <algorithm>
 #include "opencl.h"
 
 const char* CL_KERNEL_SOURCE = "sum.cl";
-const char* CL_KERNEL_NAME = "sum";
 
-const size_t SIZE = 100'000'000; // Array size
+// Kernel variants and their vector widths, "sum" adds one element per work-item
+const std::vector<std::string> CL_KERNEL_VARIANTS = { "sum", "sumVec2", "sumVec4", "sumVec8", "sumVec16" };
+const size_t VARIANT_WIDTHS[] = { 1, 2, 4, 8, 16 };
 
-int main()
+const size_t SIZE = 100'000'000; // Default array size
+const int VARIANT_RUNS = 3;      // timed runs of each variant, the best one is reported
+
+// Variant for the preferred int vector width of the device
+
+size_t preferredVariant(const DeviceInfo& device)
 {
-    size_t tsStart, tsEnd;
+    size_t variant = 0;
+    while (variant + 1 < CL_KERNEL_VARIANTS.size() && VARIANT_WIDTHS[variant + 1] <= device.preferredWidthInt) variant++;
+    return variant;
+}
 
-    // Input data
-    int *a = new int[SIZE], *b = new int[SIZE], *result = new int[SIZE];
-    for (int i = 0; i < SIZE; i++) { a[i] = 2 * i; b[i] = -i; }
+// Global size of a variant: one work-item per element for the scalar kernel, otherwise enough
+// work-items to fill the device, rounded to 1024 so that the tuner finds dividing local sizes
 
-    printf("\n~~~~~ Let's go with OpenCL\n");
+size_t variantGlobalSize(size_t variant, size_t count, const DeviceInfo& device)
+{
+    if (VARIANT_WIDTHS[variant] == 1) return count;
+    size_t vectors = std::max<size_t>(count / VARIANT_WIDTHS[variant], 1);
+    size_t items = std::min<size_t>(vectors, std::max<size_t>(device.computeUnits, 1) * 2048);
+    return (items + 1023) / 1024 * 1024;
+}
+
+// Run every kernel variant on device-resident arrays and report the GB/s achieved by each
 
-    OpenCL job(CL_KERNEL_SOURCE, CL_KERNEL_NAME);
+void runVariants(const std::shared_ptr<Context>& context, const int* a, const int* b, int* result, size_t count)
+{
+    const DeviceInfo& device = context->deviceInfo();
+    OpenCL job(context, CL_KERNEL_SOURCE, CL_KERNEL_VARIANTS);
+    DeviceBuffer devA = job.allocate<int>("a", count), devB = job.allocate<int>("b", count), devResult = job.allocate<int>("result", count);
+    job.write(devA, a, count);
+    job.write(devB, b, count);
+    int bound = (int)count;
+    double gb = 3.0 * count * sizeof(int) * 1e-9;
 
-    tsStart = getTime();
-    job.run(
+    printf("%zu elements, preferred int vector width %u\n", count, device.preferredWidthInt);
+    for (size_t k = 0; k < CL_KERNEL_VARIANTS.size(); k++)
+    {
+        TimeSpan span(CL_KERNEL_VARIANTS[k]);
+        NDRange range = job.tune((int)k, variantGlobalSize(k, count, device), devA, devB, devResult, scalar(bound));
+        double best = 0;
+        for (int run = 0; run < VARIANT_RUNS; run++)
         {
-            {ArgTypes::IN_IBUF,  (void*)a,      SIZE },
-            {ArgTypes::IN_IBUF,  (void*)b,      SIZE },
-            {ArgTypes::OUT_IBUF, (void*)result, SIZE },
-            {ArgTypes::INT,      (void*)&SIZE,  1    }
-        },
-        { SIZE }
-    );
-    tsEnd = getTime();
-    size_t tsWopenCL = tsEnd - tsStart;
+            Timer timer;
+            job.launch((int)k, range);
+            job.finish();
+            double ms = timer.ms();
+            if (run == 0 || ms < best) best = ms;
+        }
+        job.read(devResult, result, count);
+        bool correct = true;
+        for (size_t i = 0; i < count && correct; i++) correct = result[i] == a[i] + b[i];
+        printf("%10s: %.3f ms, %.2f GB/s, global %zu, local %zu%s%s\n", CL_KERNEL_VARIANTS[k].c_str(), best, gb / best * 1e3,
+            range.global[0], range.local[0], k == preferredVariant(device) ? " (preferred)" : "", correct ? "" : " WRONG RESULT");
+    }
+}
+
+// Usage: sum [auto|streamed|whole|zerocopy] [size], "streamed" uploads, computes and downloads
+// chunks in an overlapped pipeline, so the size is not limited by device memory, "whole" copies
+// the arrays to device buffers, "zerocopy" runs on buffers wrapping the host arrays, "auto" (default)
+// picks zerocopy when the device shares memory with the host and streamed otherwise.
+// The whole and zerocopy runs use the kernel variant of the preferred int vector width, and all
+// variants are then timed on device-resident arrays
+
+int main(int argc, char** argv)
+{
+    std::string mode = argc > 1 ? argv[1] : "auto";
+    size_t size = argc > 2 ? strtoull(argv[2], NULL, 10) : SIZE;
+    if (mode != "auto" && mode != "streamed" && mode != "whole" && mode != "zerocopy") { printf("Error: unknown mode %s\n", mode.c_str()); return 1; }
+    int bound = (int)std::min<size_t>(size, INT_MAX); // kernel bound check, streamed chunks never exceed it
+
+    // Input data, page-aligned so that zero-copy buffers can wrap it
+    int* a = (int*)OpenCL::allocHostMemory(size * sizeof(int));
+    int* b = (int*)OpenCL::allocHostMemory(size * sizeof(int));
+    int* result = (int*)OpenCL::allocHostMemory(size * sizeof(int));
+    for (size_t i = 0; i < size; i++) { a[i] = 2 * i; b[i] = -i; }
+
+    printf("\n~~~~~ Let's go with OpenCL\n");
+
+    TimeSpan spanOpenCL("with OpenCL");
+    TimeSpan spanInit("init");
+    auto context = Context::create();
+    const DeviceInfo& device = context->deviceInfo();
+    if (mode == "auto") mode = context->unifiedMemory() ? "zerocopy" : "streamed";
+    if (mode != "streamed" && size > INT_MAX)
+    {
+        // the kernels index with int, only streamed chunks stay below INT_MAX elements
+        printf("Error: %s mode supports up to %d elements, use streamed mode for %zu\n", mode.c_str(), INT_MAX, size);
+        OpenCL::freeHostMemory(a);
+        OpenCL::freeHostMemory(b);
+        OpenCL::freeHostMemory(result);
+        return 1;
+    }
+    size_t variant = mode == "streamed" ? 0 : preferredVariant(device);     // streamed chunks need one element per work-item
+    OpenCL job(context, CL_KERNEL_SOURCE, CL_KERNEL_VARIANTS[variant]);
+    spanInit.stop();
+    job.setHostMemory(mode == "zerocopy" ? HostMemory::USE_HOST_PTR : HostMemory::COPY);
+    printf("Device %s (%s)\n", device.name.c_str(), device.typeName().c_str());
+    printf("Kernel %s\n", CL_KERNEL_VARIANTS[variant].c_str());
+    printf("Program %s in %.3f ms\n", job.programFromCache() ? "loaded from binary cache" : "compiled from source", job.programBuildTime());
+
+    TimeSpan spanRun("run");
+    std::vector<std::tuple<ArgTypes, void*, size_t>> args = {
+        {ArgTypes::IN_IBUF,  (void*)a,      size },
+        {ArgTypes::IN_IBUF,  (void*)b,      size },
+        {ArgTypes::OUT_IBUF, (void*)result, size },
+        {ArgTypes::INT,      (void*)&bound, 1    }
+    };
+    NDRange range = size;
+    if (mode == "streamed") job.runStreamed(args);
+    else
+    {
+        // the local size is tuned on the first run for this size and device, then read from the tuning database
+        KernelArg argA = in(a, size), argB = in(b, size), argResult = out(result, size), argBound = scalar(bound);
+        job.createBuffers(argA, argB, argResult, argBound);
+        range = job.tune(0, variantGlobalSize(variant, size, device), argA, argB, argResult, argBound);
+        job.launch(0, range);
+        job.readBuffers(argA, argB, argResult, argBound);
+        job.freeBuffers();
+    }
+    double tsWopenCL = spanRun.stop() * 1e-6;
+    if (range.hasLocal) printf("Local size %zu\n", range.local[0]);
+    spanOpenCL.stop();
+    BufferPoolStats pool = job.bufferPoolStats();
 
     printf("First 10 results:\n");
-    for (int i = 0; i < 10 && i < SIZE; i++) printf("result[%d] = %d\n", i, result[i]);
+    for (int i = 0; i < 10 && i < size; i++) printf("result[%d] = %d\n", i, result[i]);
+    size_t wrong = 0;
+    for (size_t i = 0; i < size; i++) wrong += result[i] != a[i] + b[i];
+    if (wrong) printf("WRONG RESULT: %zu of %zu elements differ from a[i] + b[i]\n", wrong, size);
+    else printf("All %zu results are correct\n", size);
 
     printf("\n~~~~~ Let's go without OpenCL\n");
 
-    tsStart = getTime();
-    for (int i = 0; i < SIZE; i++)
+    TimeSpan spanCPU("without OpenCL");
+    for (size_t i = 0; i < size; i++)
     {
         result[i] = a[i] + b[i]; 
     }   
-    tsEnd = getTime();
-    size_t tsWOopenCL = tsEnd - tsStart;
+    double tsWOopenCL = spanCPU.stop() * 1e-6;
 
     printf("First 10 results:\n");
-    for (int i = 0; i < 10 && i < SIZE; i++)
+    for (int i = 0; i < 10 && i < size; i++)
     {
         printf("result[%d] = %d\n", i, result[i]);
     }
 
-    delete[] a;
-    delete[] b;
-    delete[] result;
+    printf("\n~~~~~ Kernel variants\n");
+
+    size_t variantSize = std::min<size_t>({ size, (size_t)device.maxAllocSize / sizeof(int), (size_t)device.globalMemSize / 4 / sizeof(int), INT_MAX });
+    runVariants(context, a, b, result, variantSize);
+
+    OpenCL::freeHostMemory(a);
+    OpenCL::freeHostMemory(b);
+    OpenCL::freeHostMemory(result);
 
+    double gb = 3.0 * size * sizeof(int) * 1e-9; // bytes read and written
     printf("\n~~~~~ Execution time\n");
-    printf("     with OpenCL: %zu ms\n", tsWopenCL);
-    printf("  without OpenCL: %zu ms\n", tsWOopenCL);
+    printf("     with OpenCL: %.3f ms, %.2f GB/s (%s)\n", tsWopenCL, gb / tsWopenCL * 1e3, mode.c_str());
+    printf("  without OpenCL: %.3f ms, %.2f GB/s\n", tsWOopenCL, gb / tsWOopenCL * 1e3);
+    printf("     buffer pool: %zu hits, %zu misses, %zu evictions\n", pool.hits, pool.misses, pool.evictions);
+    printTimeReport();
     printf("\n~~~~~ Bye!\n");
 
-    return 0;
-}
\ No newline at end of file
+    return wrong ? 1 : 0;
+}